@@ -0,0 +1,223 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <map>
+#include <random>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include <filesystem>
+
+#include <benchmark/benchmark.h>
+#include <opencv2/core.hpp>
+
+#include "dicom.hpp"
+#include "image_stack.hpp"
+#include "scene.hpp"
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// where the real data lives, and which synthetic volumes to make, both can be changed with
+// DUMBICOM_BENCH_DATA=<folder> and DUMBICOM_BENCH_SIZES=<x>x<y>x<z>,...
+static const char *DEFAULT_DATA = "data";
+static const char *DEFAULT_SIZES = "256x256x64,512x512x128";
+static const vector<string> DATASETS{"male_head", "female_head"};
+
+
+// gets at the protected parts, so they can be timed on their own
+class bench_stack : public image_stack {
+public:
+    explicit bench_stack(image_stack &from) : image_stack(from) {}
+
+    using image_stack::establish_min_max;
+};
+
+
+struct volume {
+    string name;
+    shared_ptr<image_stack> stack;
+};
+
+
+static string env_or(const char *name, const char *fallback) {
+    const char *value = getenv(name);
+    return value ? value : fallback;
+}
+
+static void set_throughput(benchmark::State &state, size_t voxels) {
+    // both per second of wall time, as rates
+    state.counters["voxels"] = benchmark::Counter((double) (state.iterations() * voxels), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed((int64_t) (state.iterations() * voxels * sizeof(unsigned short)));
+}
+
+static shared_ptr<image_stack> synthetic_stack(unsigned short x, unsigned short y, unsigned short z) {
+    // something like a head, a ball of soft tissue in a shell of bone, in noisy air
+    vector<unsigned short> data((size_t) x * y * z);
+    mt19937 random(42);
+    uniform_int_distribution<int> noise(0, 60);
+
+    for (unsigned short k = 0; k < z; k++) {
+        for (unsigned short j = 0; j < y; j++) {
+            for (unsigned short i = 0; i < x; i++) {
+                double dx = (i - x / 2.) / (x * .4);
+                double dy = (j - y / 2.) / (y * .45);
+                double dz = (k - z / 2.) / (z * .5);
+                double radius = dx * dx + dy * dy + dz * dz;
+
+                unsigned short value = noise(random);
+                if (radius < .85)
+                    value += 1000;
+                else if (radius < 1.)
+                    value += 2000;
+
+                data[((size_t) k * y + j) * x + i] = value;
+            }
+        }
+    }
+
+    return make_shared<image_stack>(data.data(), x, y, z);
+}
+
+static vector<volume> synthetic_volumes() {
+    vector<volume> volumes;
+    stringstream sizes(env_or("DUMBICOM_BENCH_SIZES", DEFAULT_SIZES));
+    string size;
+
+    while (getline(sizes, size, ',')) {
+        unsigned short x, y, z;
+        char separator;
+        stringstream parts(size);
+        if (!(parts >> x >> separator >> y >> separator >> z)) {
+            cerr << "Malformed benchmark volume size: " << size << endl;
+            exit(1);
+        }
+        volumes.push_back(volume{"synthetic_" + size, synthetic_stack(x, y, z)});
+    }
+
+    return volumes;
+}
+
+static vector<volume> real_volumes() {
+    vector<volume> volumes;
+    fs::path data = env_or("DUMBICOM_BENCH_DATA", DEFAULT_DATA);
+
+    for (const string &dataset : DATASETS) {
+        fs::path folder = data / dataset;
+        if (!fs::is_directory(folder))
+            continue;
+
+        dicom dcm(folder.string(), max(thread::hardware_concurrency(), 1u));
+        auto stack = make_shared<image_stack>(dcm);
+        volumes.push_back(volume{dataset, stack});
+    }
+
+    return volumes;
+}
+
+
+static void bench_dicom(benchmark::State &state, const string &folder) {
+    unsigned short threads = max(thread::hardware_concurrency(), 1u);
+    size_t voxels = 0;
+
+    for (auto _ : state) {
+        dicom dcm(folder, threads);
+        voxels = (size_t) dcm.get_x() * dcm.get_y() * dcm.get_z();
+    }
+
+    set_throughput(state, voxels);
+}
+
+static void bench_stack_op(benchmark::State &state, const volume &input,
+                           const function<void(bench_stack &, image_stack &)> &op) {
+    // every iteration starts from the same data, with a ready made mask for &
+    bench_stack stack(*input.stack);
+    image_stack mask(*input.stack);
+    mask.threshold_data(250);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        stack.copy_from(*input.stack);
+        state.ResumeTiming();
+
+        op(stack, mask);
+    }
+
+    set_throughput(state, (size_t) stack.get_x() * stack.get_y() * stack.get_z());
+}
+
+static void bench_scene(benchmark::State &state, const volume &input) {
+    image_stack stack(*input.stack);
+
+    for (auto _ : state) {
+        scene s(stack.get_data_ptr(), stack.get_x(), stack.get_y(), stack.get_z());
+        benchmark::DoNotOptimize(s);
+    }
+
+    set_throughput(state, (size_t) stack.get_x() * stack.get_y() * stack.get_z());
+}
+
+
+static void register_benchmarks(const vector<volume> &volumes) {
+    fs::path data = env_or("DUMBICOM_BENCH_DATA", DEFAULT_DATA);
+    for (const string &dataset : DATASETS) {
+        fs::path folder = data / dataset;
+        if (fs::is_directory(folder))
+            benchmark::RegisterBenchmark(("dicom/" + dataset).c_str(), bench_dicom, folder.string())
+                    ->Unit(benchmark::kMillisecond);
+    }
+
+    // the same brushes main uses by default
+    static const unsigned short brush = 25;
+    const map<string, function<void(bench_stack &, image_stack &)>> ops{
+            {"threshold_data", [](bench_stack &s, image_stack &) { s.threshold_data(250); }},
+            {"mask_roi", [](bench_stack &s, image_stack &) {
+                s.mask_roi(Point2D{(unsigned short) (s.get_x() / 8), (unsigned short) (s.get_y() / 8)},
+                           Point2D{(unsigned short) (s.get_x() * 7 / 8), (unsigned short) (s.get_y() * 7 / 8)});
+            }},
+            {"open_stack", [](bench_stack &s, image_stack &) { s.open_stack(brush); }},
+            {"close_stack", [](bench_stack &s, image_stack &) { s.close_stack(brush * 2); }},
+            {"dilate_stack", [](bench_stack &s, image_stack &) { s.dilate_stack(brush * 2); }},
+            {"erode_stack", [](bench_stack &s, image_stack &) { s.erode_stack(brush); }},
+            {"operator&", [](bench_stack &s, image_stack &mask) { s & mask; }},
+            {"establish_min_max", [](bench_stack &s, image_stack &) { s.establish_min_max(); }},
+            {"non_zero_bounds", [](bench_stack &, image_stack &mask) {
+                // the mask has empty space around the head, like a cleaned volume
+                Point3D from{}, to{};
+                benchmark::DoNotOptimize(mask.non_zero_bounds(from, to));
+            }},
+    };
+
+    for (const volume &input : volumes) {
+        for (const auto &[name, op] : ops)
+            benchmark::RegisterBenchmark((name + "/" + input.name).c_str(), bench_stack_op, input, op)
+                    ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("scene/" + input.name).c_str(), bench_scene, input)
+                ->Unit(benchmark::kMillisecond);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    vector<volume> volumes = synthetic_volumes();
+    vector<volume> real = real_volumes();
+    volumes.insert(volumes.end(), real.begin(), real.end());
+
+    register_benchmarks(volumes);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,291 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <algorithm>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "bit_mask.hpp"
+#include "image_stack.hpp"
+#include "simd_kernels.hpp"
+#include "profiler.hpp"
+
+
+using namespace std;
+
+
+// one row of a structuring element, covering x offsets lo to hi at y offset dy from the anchor
+struct element_run {
+    int dy;
+    int lo;
+    int hi;
+};
+
+static vector<element_run> element_runs(unsigned short brush_size) {
+    // the exact element image_stack hands to opencv, whose rows are all in one piece
+    cv::Mat element = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(brush_size, brush_size));
+    int anchor_x = element.cols / 2;
+    int anchor_y = element.rows / 2;
+
+    vector<element_run> runs;
+    for (int y = 0; y < element.rows; y++) {
+        const unsigned char *row = element.ptr<unsigned char>(y);
+        int x = 0;
+        while (x < element.cols && !row[x])
+            x++;
+        if (x == element.cols)
+            continue;
+
+        int lo = x;
+        while (x < element.cols && row[x])
+            x++;
+        runs.push_back(element_run{y - anchor_y, lo - anchor_x, x - 1 - anchor_x});
+    }
+
+    return runs;
+}
+
+static uint64_t range_bits(size_t word, size_t first, size_t last) {
+    // bits of a word that lie between the columns first and last, both included
+    size_t word_first = word * 64;
+    size_t word_last = word_first + 63;
+    if (last < word_first || word_last < first)
+        return 0;
+
+    size_t lo = std::max(first, word_first) - word_first;
+    size_t hi = std::min(last, word_last) - word_first;
+    return (~0ull >> (63 - hi)) & (~0ull << lo);
+}
+
+static void shift_row(const uint64_t *src, uint64_t *dst, size_t words, long offset, uint64_t fill) {
+    // dst[x] = src[x + offset], where everything outside of src is fill
+    long word_offset = offset >> 6;
+    unsigned int bit_offset = offset & 63;
+
+    auto word_at = [&](long i) { return (i < 0 || i >= (long) words) ? fill : src[i]; };
+
+    for (long j = 0; j < (long) words; j++) {
+        uint64_t low = word_at(j + word_offset);
+        if (bit_offset)
+            low = (low >> bit_offset) | (word_at(j + word_offset + 1) << (64 - bit_offset));
+        dst[j] = low;
+    }
+}
+
+static inline void combine_row(uint64_t *dst, const uint64_t *src, size_t words, bool dilate) {
+    if (dilate)
+        for (size_t j = 0; j < words; j++)
+            dst[j] |= src[j];
+    else
+        for (size_t j = 0; j < words; j++)
+            dst[j] &= src[j];
+}
+
+static void run_row(const uint64_t *src, uint64_t *dst, uint64_t *span_row, uint64_t *tmp,
+                    size_t words, size_t length, bool dilate) {
+    // dst[x] = src[x] op ... op src[x + length - 1], doubling the span covered by span_row,
+    // and adding it to dst wherever length has a bit set, so it takes log(length) shifts
+    uint64_t fill = dilate ? 0 : ~0ull;
+    copy(src, src + words, span_row);
+
+    size_t span = 1;
+    size_t covered = 0;
+    while (true) {
+        if (length & span) {
+            if (covered) {
+                shift_row(span_row, tmp, words, (long) covered, fill);
+                combine_row(dst, tmp, words, dilate);
+            } else {
+                copy(span_row, span_row + words, dst);
+            }
+            covered += span;
+        }
+
+        if (covered == length)
+            return;
+
+        shift_row(span_row, tmp, words, (long) span, fill);
+        combine_row(span_row, tmp, words, dilate);
+        span *= 2;
+    }
+}
+
+
+bit_mask::bit_mask(unsigned short x, unsigned short y, unsigned short z) :
+    cols(x),
+    rows(y),
+    image_count(z),
+    words_per_row((x + 63) / 64),
+    words(words_per_row * y * z, 0) {}
+
+bit_mask::bit_mask(image_stack &from, unsigned short threshold) :
+    bit_mask(from.get_x(), from.get_y(), from.get_z()) {
+    scoped_timer timer("bit_mask::bit_mask", sizeof(unsigned short) * cols * rows * image_count, cv::getNumThreads());
+    size_t slice_fields = (size_t) rows * cols;
+    const simd_kernels &kernels = active_kernels();
+
+    from.for_each_slab([&](unsigned short *slab_ptr, unsigned short first, unsigned short count) {
+        cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++)
+                for (unsigned short y = 0; y < rows; y++)
+                    kernels.threshold_bits(slab_ptr + i * slice_fields + (size_t) y * cols, cols, threshold,
+                                           row_ptr(y, first + i));
+        });
+    }, false);
+}
+
+uint64_t *bit_mask::row_ptr(unsigned short y, unsigned short z) {
+    return words.data() + ((size_t) z * rows + y) * words_per_row;
+}
+
+const uint64_t *bit_mask::row_at(unsigned short y, unsigned short z) const {
+    return words.data() + ((size_t) z * rows + y) * words_per_row;
+}
+
+void bit_mask::clear_padding(uint64_t *row) const {
+    if (cols % 64)
+        row[words_per_row - 1] &= ~0ull >> (64 - cols % 64);
+}
+
+void bit_mask::mask_roi(Point2D from, Point2D to) {
+    Point3D from3D{from.x, from.y, 0};
+    Point3D to3D{to.x, to.y, get_z()};
+    mask_roi(from3D, to3D);
+}
+
+void bit_mask::mask_roi(Point3D from, Point3D to) {
+    // same as image_stack::mask_roi, but whole words at a time
+    for (unsigned short z = 0; z < image_count; z++) {
+        for (unsigned short y = 0; y < rows; y++) {
+            uint64_t *row = row_ptr(y, z);
+
+            if (z < from.z || to.z < z || y < from.y || to.y < y) {
+                fill(row, row + words_per_row, 0);
+                continue;
+            }
+
+            for (size_t word = 0; word < words_per_row; word++)
+                row[word] &= range_bits(word, from.x, to.x);
+        }
+    }
+}
+
+void bit_mask::morph_mask(int operation, unsigned short brush_size) {
+    scoped_timer timer("bit_mask::morph_mask", words.size() * sizeof(uint64_t), cv::getNumThreads());
+    vector<element_run> runs = element_runs(brush_size);
+    if (runs.empty())
+        return;
+
+    // rows of the same width share their horizontal pass
+    vector<pair<int, int>> widths;
+    vector<size_t> width_of_run;
+    int reach = 0;
+    for (const element_run &run : runs) {
+        pair<int, int> width{run.lo, run.hi};
+        auto found = find(widths.begin(), widths.end(), width);
+        width_of_run.push_back(found - widths.begin());
+        if (found == widths.end())
+            widths.push_back(width);
+        reach = std::max({reach, -run.lo, run.hi});
+    }
+
+    // open and close are erode and dilate in a row
+    vector<bool> steps;
+    if (operation == cv::MORPH_DILATE || operation == cv::MORPH_ERODE)
+        steps = {operation == cv::MORPH_DILATE};
+    else if (operation == cv::MORPH_OPEN)
+        steps = {false, true};
+    else
+        steps = {true, false};
+
+    // rows get a margin of whole words on both sides, so the shifts never lose anything that matters
+    size_t margin = reach / 64 + 1;
+    size_t wide_words = words_per_row + 2 * margin;
+    size_t slice_words = (size_t) rows * words_per_row;
+
+    cv::parallel_for_(cv::Range(0, image_count), [&](const cv::Range &range) {
+        vector<uint64_t> wide(wide_words);
+        vector<uint64_t> run_wide(wide_words);
+        vector<uint64_t> span_row(wide_words);
+        vector<uint64_t> tmp(wide_words);
+        // the horizontal passes of all rows, one slice per width
+        vector<uint64_t> passes(widths.size() * slice_words);
+
+        for (int z = range.start; z < range.end; z++) {
+            for (bool dilate : steps) {
+                // outside the slice is 0 when dilating and 1 when eroding, like opencv's default border
+                uint64_t fill = dilate ? 0 : ~0ull;
+
+                for (unsigned short y = 0; y < rows; y++) {
+                    const uint64_t *row = row_ptr(y, z);
+                    std::fill(wide.begin(), wide.end(), fill);
+                    copy(row, row + words_per_row, wide.begin() + margin);
+                    if (!dilate && cols % 64)
+                        wide[margin + words_per_row - 1] |= ~0ull << (cols % 64);
+
+                    for (size_t w = 0; w < widths.size(); w++) {
+                        size_t length = widths[w].second - widths[w].first + 1;
+                        run_row(wide.data(), run_wide.data(), span_row.data(), tmp.data(), wide_words, length,
+                                dilate);
+                        // runs start at lo, and the margin takes the slice back to column 0
+                        shift_row(run_wide.data(), tmp.data(), wide_words, widths[w].first, fill);
+                        uint64_t *pass = passes.data() + w * slice_words + (size_t) y * words_per_row;
+                        copy(tmp.begin() + margin, tmp.begin() + margin + words_per_row, pass);
+                    }
+                }
+
+                // the vertical pass combines the horizontal ones of all rows the element covers
+                for (unsigned short y = 0; y < rows; y++) {
+                    uint64_t *row = row_ptr(y, z);
+                    std::fill(row, row + words_per_row, fill);
+
+                    for (size_t r = 0; r < runs.size(); r++) {
+                        int source_y = y + runs[r].dy;
+                        if (source_y < 0 || source_y >= rows)
+                            continue;
+
+                        const uint64_t *pass = passes.data() + width_of_run[r] * slice_words
+                                               + (size_t) source_y * words_per_row;
+                        combine_row(row, pass, words_per_row, dilate);
+                    }
+
+                    clear_padding(row);
+                }
+            }
+        }
+    });
+}
+
+void bit_mask::open_mask(unsigned short brush_size) {
+    morph_mask(cv::MORPH_OPEN, brush_size);
+}
+
+void bit_mask::close_mask(unsigned short brush_size) {
+    morph_mask(cv::MORPH_CLOSE, brush_size);
+}
+
+void bit_mask::dilate_mask(unsigned short brush_size) {
+    morph_mask(cv::MORPH_DILATE, brush_size);
+}
+
+void bit_mask::erode_mask(unsigned short brush_size) {
+    morph_mask(cv::MORPH_ERODE, brush_size);
+}
+
+size_t bit_mask::get_words_per_row() const {
+    return words_per_row;
+}
+
+unsigned short bit_mask::get_x() const {
+    return cols;
+}
+
+unsigned short bit_mask::get_y() const {
+    return rows;
+}
+
+unsigned short bit_mask::get_z() const {
+    return image_count;
+}
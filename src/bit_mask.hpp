@@ -0,0 +1,60 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_BIT_MASK_HPP
+#define ABGABE_CG_VIS_BIT_MASK_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "convenience.hpp"
+
+using namespace std;
+
+
+class image_stack;
+
+
+// binary mask with one bit per voxel, a sixteenth of what an image_stack needs for the same,
+// bits are packed lowest first into 64 bit words, and every row starts on a new word
+class bit_mask {
+public:
+    bit_mask(unsigned short x, unsigned short y, unsigned short z);
+    // sets the bits of all voxels that are at least threshold, like image_stack::threshold_data
+    bit_mask(image_stack &from, unsigned short threshold);
+
+    void mask_roi(Point3D from, Point3D to);
+    void mask_roi(Point2D from, Point2D to);
+
+    // same elliptical brushes as the opencv engine of image_stack, with the same results,
+    // but working on a whole word of voxels at a time
+    void open_mask(unsigned short brush_size);
+    void close_mask(unsigned short brush_size);
+    void dilate_mask(unsigned short brush_size);
+    void erode_mask(unsigned short brush_size);
+
+    // the words_per_row words of a row, bits past the last column are always 0
+    const uint64_t *row_at(unsigned short y, unsigned short z) const;
+    size_t get_words_per_row() const;
+
+    unsigned short get_x() const;
+    unsigned short get_y() const;
+    unsigned short get_z() const;
+protected:
+    const unsigned short cols;
+    const unsigned short rows;
+    const unsigned short image_count;
+    const size_t words_per_row;
+
+    vector<uint64_t> words;
+
+    uint64_t *row_ptr(unsigned short y, unsigned short z);
+    void clear_padding(uint64_t *row) const;
+
+    void morph_mask(int operation, unsigned short brush_size);
+};
+
+
+#endif //ABGABE_CG_VIS_BIT_MASK_HPP
@@ -0,0 +1,189 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <iostream>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "brick_cache.hpp"
+
+namespace fs = std::filesystem;
+
+
+brick_cache::brick_cache(size_t memory_budget, const string &scratch_dir)
+        : budget(memory_budget),
+          resident(0),
+          warned_over_budget(false),
+          scratch_fd(-1),
+          scratch_end(0) {
+
+    fs::path dir = scratch_dir.empty() ? fs::temp_directory_path() : fs::path(scratch_dir);
+    string scratch_path = (dir / "dumbicom_bricks_XXXXXX").string();
+
+    scratch_fd = mkstemp(scratch_path.data());
+    if (scratch_fd < 0) {
+        cerr << "Can't create scratch file for bricks in: " << dir.string() << endl;
+        exit(10);
+    }
+
+    // nobody else needs to see it, and this way it's gone when we are
+    unlink(scratch_path.data());
+}
+
+brick_cache::~brick_cache() {
+    for (brick &b: bricks)
+        delete[] b.data_ptr;
+
+    close(scratch_fd);
+}
+
+size_t brick_cache::allocate(size_t bytes) {
+    lock_guard<mutex> guard(lock);
+
+    // reuse the slot of a discarded brick with the same size, if there is one
+    for (auto it = free_bricks.begin(); it != free_bricks.end(); ++it) {
+        brick &b = bricks[*it];
+        if (b.bytes != bytes)
+            continue;
+
+        size_t index = *it;
+        free_bricks.erase(it);
+
+        b.in_use = true;
+        b.on_disk = false;
+        b.dirty = false;
+        return index;
+    }
+
+    brick b{};
+    b.bytes = bytes;
+    b.offset = scratch_end;
+    b.data_ptr = nullptr;
+    b.pins = 0;
+    b.dirty = false;
+    b.on_disk = false;
+    b.in_use = true;
+    b.lru_position = lru.end();
+
+    scratch_end += (off_t) bytes;
+
+    bricks.push_back(b);
+    return bricks.size() - 1;
+}
+
+void brick_cache::discard(size_t index) {
+    lock_guard<mutex> guard(lock);
+    brick &b = bricks[index];
+
+    if (b.data_ptr != nullptr) {
+        if (b.lru_position != lru.end()) {
+            lru.erase(b.lru_position);
+            b.lru_position = lru.end();
+        }
+
+        delete[] b.data_ptr;
+        b.data_ptr = nullptr;
+        resident -= b.bytes;
+    }
+
+    b.pins = 0;
+    b.in_use = false;
+    free_bricks.push_back(index);
+}
+
+unsigned short *brick_cache::acquire(size_t index, bool writes) {
+    lock_guard<mutex> guard(lock);
+    brick &b = bricks[index];
+
+    if (b.data_ptr == nullptr) {
+        make_room(b.bytes);
+
+        b.data_ptr = new unsigned short[b.bytes / sizeof(unsigned short)];
+        resident += b.bytes;
+
+        if (b.on_disk) {
+            char *dst = reinterpret_cast<char *>(b.data_ptr);
+            size_t done = 0;
+            while (done < b.bytes) {
+                ssize_t n = pread(scratch_fd, dst + done, b.bytes - done, b.offset + (off_t) done);
+                if (n <= 0) {
+                    cerr << "Can't read brick from scratch file" << endl;
+                    exit(11);
+                }
+                done += n;
+            }
+        } else {
+            memset(b.data_ptr, 0, b.bytes);
+        }
+    } else if (b.lru_position != lru.end()) {
+        // it's pinned now, so it can't be evicted
+        lru.erase(b.lru_position);
+        b.lru_position = lru.end();
+    }
+
+    b.pins++;
+    b.dirty = b.dirty || writes;
+
+    return b.data_ptr;
+}
+
+void brick_cache::release(size_t index) {
+    lock_guard<mutex> guard(lock);
+    brick &b = bricks[index];
+
+    if (b.pins == 0 || --b.pins > 0)
+        return;
+
+    b.lru_position = lru.insert(lru.end(), index);
+}
+
+size_t brick_cache::get_memory_budget() const {
+    return budget;
+}
+
+size_t brick_cache::get_resident_bytes() const {
+    return resident;
+}
+
+void brick_cache::page_out(size_t index) {
+    brick &b = bricks[index];
+
+    if (b.dirty) {
+        const char *src = reinterpret_cast<const char *>(b.data_ptr);
+        size_t done = 0;
+        while (done < b.bytes) {
+            ssize_t n = pwrite(scratch_fd, src + done, b.bytes - done, b.offset + (off_t) done);
+            if (n <= 0) {
+                cerr << "Can't write brick to scratch file" << endl;
+                exit(12);
+            }
+            done += n;
+        }
+
+        b.on_disk = true;
+        b.dirty = false;
+    }
+
+    lru.erase(b.lru_position);
+    b.lru_position = lru.end();
+
+    delete[] b.data_ptr;
+    b.data_ptr = nullptr;
+    resident -= b.bytes;
+}
+
+void brick_cache::make_room(size_t bytes) {
+    // evict the least recently used bricks, until the new one fits
+    while (resident + bytes > budget && !lru.empty())
+        page_out(lru.front());
+
+    // everything left is pinned, so all we can do is complain
+    if (resident + bytes > budget && !warned_over_budget) {
+        cerr << "Warning: memory budget too small for the pinned bricks, exceeding it" << endl;
+        warned_over_budget = true;
+    }
+}
@@ -0,0 +1,70 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_BRICK_CACHE_HPP
+#define ABGABE_CG_VIS_BRICK_CACHE_HPP
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+using namespace std;
+
+
+// pages fixed size bricks of voxels in and out of a scratch file,
+// keeping at most memory_budget bytes of them in memory at once
+class brick_cache {
+public:
+    explicit brick_cache(size_t memory_budget, const string &scratch_dir = "");
+    ~brick_cache();
+
+    brick_cache(const brick_cache &) = delete;
+    brick_cache &operator=(const brick_cache &) = delete;
+
+    // reserves a new brick, which reads as all zeros until written
+    size_t allocate(size_t bytes);
+    // drops a brick without writing it back, its slot in the file is reused
+    void discard(size_t brick);
+
+    // pages the brick in (if needed) and pins it until release is called
+    unsigned short *acquire(size_t brick, bool writes);
+    void release(size_t brick);
+
+    size_t get_memory_budget() const;
+    size_t get_resident_bytes() const;
+protected:
+    struct brick {
+        size_t bytes;
+        off_t offset;
+        unsigned short *data_ptr;
+        unsigned int pins;
+        bool dirty;
+        bool on_disk;
+        bool in_use;
+        list<size_t>::iterator lru_position;
+    };
+
+    void page_out(size_t index);
+    void make_room(size_t bytes);
+
+    size_t budget;
+    size_t resident;
+    bool warned_over_budget;
+
+    int scratch_fd;
+    off_t scratch_end;
+
+    vector<brick> bricks;
+    vector<size_t> free_bricks;
+    // resident and unpinned bricks, least recently used first
+    list<size_t> lru;
+
+    mutex lock;
+};
+
+
+#endif //ABGABE_CG_VIS_BRICK_CACHE_HPP
@@ -17,4 +17,11 @@ struct Point3D {
     unsigned short z;
 };
 
+enum class render_engine {
+    // ray casting on the GPU
+    gpu,
+    // ray casting on the CPU, for machines without a usable GPU
+    cpu,
+};
+
 #endif //ABGABE_CG_VIS_CONVENIENCE_HPP
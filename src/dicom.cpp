@@ -2,50 +2,128 @@
 // Created by fynn on 19.12.22.
 //
 
-#include <set>
+#include <map>
+#include <bit>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <functional>
 #include <filesystem>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <dcmtk/dcmdata/dcdatset.h>
 #include <dcmtk/dcmdata/dcfilefo.h>
 #include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcpixel.h>
+#include <dcmtk/dcmdata/dcxfer.h>
+#include <dcmtk/dcmdata/dcrledrg.h>
+#include <dcmtk/dcmjpeg/djdecode.h>
+#include <dcmtk/dcmjpls/djdecode.h>
 
 #include "dicom.hpp"
+#include "series_index.hpp"
+#include "volume_pool.hpp"
+#include "profiler.hpp"
 
 using namespace std;
 namespace fs = std::filesystem;
 
 
-dicom::dicom(const string &folder_path) {
-    input = folder_path;
+static const string CACHE_FILE_NAME = ".dumbicom_cache";
+static const string INDEX_FILE_NAME = ".dumbicom_index";
 
-    DcmFileFormat fileformat;
 
-    // find DICOM files in the folder
-    set<string> files;
-    for (auto const &entry: fs::directory_iterator{folder_path}) {
-        string file = entry.path().string();
-        // if (file.ends_with(".dcm"))
-        //     files.insert(file);
-        files.insert(file);
+static void register_codecs() {
+    // the codecs are global, and guard themselves, so every worker can decompress on its own,
+    // there is no free JPEG 2000 codec for DCMTK though
+    static once_flag registered;
+    call_once(registered, []() {
+        DJLSDecoderRegistration::registerCodecs();
+        DJDecoderRegistration::registerCodecs();
+        DcmRLEDecoderRegistration::registerCodecs();
+    });
+}
+
+
+static void for_each_index(size_t count, unsigned short threads,
+                           const function<void(DcmFileFormat &, size_t)> &work) {
+    // every worker grabs the next free index, so the result is
+    // fixed by the index, not by who worked on it
+    atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        // DcmFileFormat is not thread safe, so each worker gets its own
+        DcmFileFormat fileformat;
+        for (size_t i = next++; i < count; i = next++)
+            work(fileformat, i);
+    };
+
+    if (threads < 2 || count < 2) {
+        worker();
+        return;
     }
 
-    image_count = files.size();
+    size_t worker_count = min((size_t) threads, count);
 
-    // we expect them to be alphabetically sorted, set does that for us
-    // sort(files.begin(), files.end());
+    // the calling thread is a worker too
+    vector<thread> pool;
+    for (size_t i = 1; i < worker_count; ++i)
+        pool.emplace_back(worker);
+
+    worker();
+
+    for (thread &t: pool)
+        t.join();
+}
 
-    // load the first file, to get rows and cols, for initialising matrix
-    string first = *(files.begin());
-    if (!fileformat.loadFile(first.data()).good()) {
-        cerr << "Can't read first file for sniffing size and meta data: " << first << endl;
-        exit(5);
+static bool read_bytes(const string &file, uint64_t offset, void *destination, size_t bytes) {
+    int fd = open(file.data(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    auto *target = static_cast<unsigned char *>(destination);
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t got = pread(fd, target + done, bytes - done, (off_t) (offset + done));
+        if (got <= 0)
+            break;
+        done += got;
     }
 
-    DcmDataset *ds = fileformat.getDataset();
+    close(fd);
+    return done == bytes;
+}
 
-    ds->findAndGetUint16(DCM_Columns, cols);
-    ds->findAndGetUint16(DCM_Rows, rows);
+static uint64_t raw_pixel_offset(const string &file, size_t bytes, bool explicit_vr) {
+    // uncompressed pixels are nearly always the last element of the file,
+    // the element header right in front of them has to agree though, or DCMTK gets to read them
+    error_code error;
+    uintmax_t size = fs::file_size(file, error);
+    size_t header_size = explicit_vr ? 12 : 8;
+    if (error || size < bytes + header_size)
+        return 0;
+
+    uint64_t offset = size - bytes;
+    unsigned char header[12];
+    if (!read_bytes(file, offset - header_size, header, header_size))
+        return 0;
+
+    // (7FE0,0010) in little endian, with OW or OB in front of the length if the VR is explicit
+    static const unsigned char pixel_tag[4] = {0xE0, 0x7F, 0x10, 0x00};
+    if (memcmp(header, pixel_tag, 4) != 0)
+        return 0;
+    if (explicit_vr && (header[4] != 'O' || (header[5] != 'W' && header[5] != 'B') || header[6] || header[7]))
+        return 0;
+
+    const unsigned char *length = header + header_size - 4;
+    uint32_t value_length = length[0] | length[1] << 8 | length[2] << 16 | (uint32_t) length[3] << 24;
+    return value_length == bytes ? offset : 0;
+}
 
+static string read_meta_data(DcmDataset *ds) {
     OFString name;
     OFString birth_date;
     OFString age;
@@ -58,57 +136,394 @@ dicom::dicom(const string &folder_path) {
     ds->findAndGetOFString(DCM_PatientSex, sex);
     ds->findAndGetOFString(DCM_StudyDate, study_date);
 
+    // YYYYMMDD, anonymised files may not have them at all
     string born_string = string(birth_date.data());
-    born_string.insert(6, 1, '-').insert(4, 1, '-');
+    if (born_string.size() >= 8)
+        born_string.insert(6, 1, '-').insert(4, 1, '-');
     if (!string(age.data()).empty())
         born_string.append(" (").append(age.data()).append(")");
 
     string study_string = string(study_date.data());
-    study_string.insert(6, 1, '-').insert(4, 1, '-');
+    if (study_string.size() >= 8)
+        study_string.insert(6, 1, '-').insert(4, 1, '-');
 
+    string meta_data;
     meta_data.append("Name: ").append(name.data()).append("\n")
              .append("Born: ").append(born_string).append("\n")
              .append("Sex: ").append(sex.data()).append("\n")
              .append("Study Date: ").append(study_string).append("\n");
+    return meta_data;
+}
 
-    size_t bytes_per_img = sizeof(Uint16) * rows * cols;
+static slice_header read_header(DcmFileFormat &fileformat, const string &file) {
+    slice_header header;
+    header.file = file;
+
+    // everything up to the pixels, which are most of the file
+    if (!fileformat.loadFileUntilTag(file.data(), EXS_Unknown, EGL_noChange, DCM_MaxReadLength, ERM_autoDetect,
+                                     DCM_PixelData).good())
+        return header;
+    header.readable = true;
+
+    DcmDataset *ds = fileformat.getDataset();
+    ds->findAndGetUint16(DCM_Rows, header.rows);
+    ds->findAndGetUint16(DCM_Columns, header.cols);
+    // reports, presentation states and the like have no pixels
+    header.is_image = header.rows && header.cols;
+    if (!header.is_image)
+        return header;
+
+    OFString series;
+    ds->findAndGetOFString(DCM_SeriesInstanceUID, series);
+    header.series = series.data();
+    // whichever slice ends up first shows its meta data, so every one keeps it
+    header.meta_data = read_meta_data(ds);
+
+    header.has_instance = ds->findAndGetSint32(DCM_InstanceNumber, header.instance).good();
+
+    header.has_position = true;
+    for (unsigned long i = 0; i < 3; i++)
+        header.has_position &= ds->findAndGetFloat64(DCM_ImagePositionPatient, header.position[i], i).good();
+
+    header.has_orientation = true;
+    for (unsigned long i = 0; i < 6; i++)
+        header.has_orientation &= ds->findAndGetFloat64(DCM_ImageOrientationPatient, header.orientation[i], i).good();
+
+    // a single frame of plain little endian 16 bit pixels can be read straight from the file
+    Uint16 bits = 0;
+    Uint16 samples = 1;
+    Sint32 frames = 1;
+    ds->findAndGetUint16(DCM_BitsAllocated, bits);
+    ds->findAndGetUint16(DCM_SamplesPerPixel, samples);
+    ds->findAndGetSint32(DCM_NumberOfFrames, frames);
+
+    DcmXfer xfer(ds->getOriginalXfer());
+    bool raw = endian::native == endian::little && xfer.isLittleEndian() && !xfer.isEncapsulated()
+               && xfer.getXfer() != EXS_DeflatedLittleEndianExplicit && bits == 16 && samples == 1 && frames <= 1;
+    if (raw)
+        header.pixel_offset = raw_pixel_offset(file, sizeof(Uint16) * header.rows * header.cols, xfer.isExplicitVR());
+
+    return header;
+}
+
+static vector<slice_header> prescan(const string &folder_path, const vector<file_stamp> &listing,
+                                    unsigned short threads, bool use_index) {
+    scoped_timer timer("dicom::prescan", 0, threads);
+
+    vector<slice_header> headers(listing.size());
+    for (size_t i = 0; i < listing.size(); i++)
+        headers[i].file = (fs::path(folder_path) / listing[i].name).string();
+
+    // files the index knows, and that kept their size and time, aren't opened at all,
+    // not even those that couldn't be read last time, like a half copied slice, which changes until it's done
+    series_index index((fs::path(folder_path) / INDEX_FILE_NAME).string());
+    vector<size_t> unknown;
+    bool indexed = use_index && index.load();
+    for (size_t i = 0; i < listing.size(); i++)
+        if (!indexed || !index.find(listing[i], headers[i]))
+            unknown.push_back(i);
+
+    for_each_index(unknown.size(), threads, [&](DcmFileFormat &fileformat, size_t i) {
+        headers[unknown[i]] = read_header(fileformat, headers[unknown[i]].file);
+    });
+
+    // for new, changed or deleted files, the index is just a shortcut though, so a read only folder is fine
+    if (use_index && (!unknown.empty() || index.get_size() != listing.size()))
+        index.store(listing, headers);
+
+    size_t file_count = headers.size();
+    size_t unreadable = count_if(headers.begin(), headers.end(), [](const slice_header &header) {
+        return !header.readable;
+    });
+    if (unreadable)
+        cerr << "Warning: Couldn't read " << unreadable << " files, they are skipped until they change" << endl;
+
+    // the biggest series wins
+    map<string, size_t> series_sizes;
+    for (const slice_header &header: headers)
+        if (header.is_image)
+            series_sizes[header.series]++;
+
+    string series;
+    size_t series_size = 0;
+    for (const auto &[uid, size]: series_sizes) {
+        if (size > series_size) {
+            series = uid;
+            series_size = size;
+        }
+    }
+
+    if (series_sizes.size() > 1)
+        cerr << "Warning: Found " << series_sizes.size() << " series, showing the one with the most slices: "
+             << series << endl;
+
+    vector<slice_header> slices;
+    for (const slice_header &header: headers)
+        if (header.is_image && header.series == series)
+            slices.push_back(header);
+
+    // a slice of a different size wouldn't fit into the volume
+    if (!slices.empty()) {
+        Uint16 rows = slices.front().rows;
+        Uint16 cols = slices.front().cols;
+        erase_if(slices, [rows, cols](const slice_header &header) {
+            return header.rows != rows || header.cols != cols;
+        });
+    }
+
+    if (slices.size() < file_count)
+        cerr << "Warning: Skipped " << file_count - slices.size() << " files that aren't slices of the series" << endl;
+
+    // along the normal of the slices if they all know where they are, by instance number if they are numbered,
+    // and by file name otherwise
+    bool by_position = all_of(slices.begin(), slices.end(), [](const slice_header &header) {
+        return header.has_position && header.has_orientation;
+    });
+    bool by_instance = all_of(slices.begin(), slices.end(), [](const slice_header &header) {
+        return header.has_instance;
+    });
+
+    if (by_position) {
+        const double *o = slices.front().orientation;
+        double normal[3] = {o[1] * o[5] - o[2] * o[4],
+                            o[2] * o[3] - o[0] * o[5],
+                            o[0] * o[4] - o[1] * o[3]};
+        auto depth = [&normal](const slice_header &header) {
+            return header.position[0] * normal[0] + header.position[1] * normal[1] + header.position[2] * normal[2];
+        };
+        stable_sort(slices.begin(), slices.end(), [&depth](const slice_header &a, const slice_header &b) {
+            return depth(a) < depth(b);
+        });
+    } else if (by_instance) {
+        stable_sort(slices.begin(), slices.end(), [](const slice_header &a, const slice_header &b) {
+            return a.instance < b.instance;
+        });
+    }
+
+    return slices;
+}
+
+
+uint64_t listing_checksum(const vector<file_stamp> &listing) {
+    // FNV-1a over name, size and modification time of every file,
+    // so the cache goes stale as soon as anything in the folder changes
+    uint64_t hash = 14695981039346656037ull;
+    auto feed = [&hash](const void *bytes, size_t count) {
+        auto *byte = static_cast<const unsigned char *>(bytes);
+        for (size_t i = 0; i < count; ++i) {
+            hash ^= byte[i];
+            hash *= 1099511628211ull;
+        }
+    };
+
+    for (const file_stamp &stamp: listing) {
+        feed(stamp.name.data(), stamp.name.size() + 1);
+        feed(&stamp.size, sizeof(stamp.size));
+        feed(&stamp.mtime, sizeof(stamp.mtime));
+    }
+
+    return hash;
+}
+
+
+dicom::dicom(const string &folder_path, unsigned short threads, bool use_cache, bool deferred, bool use_index) {
+    scoped_timer timer("dicom::dicom", 0, threads);
+    input = folder_path;
+    owns_data = false;
+
+    // every file in the folder, whether it's DICOM is up to the prescan,
+    // size and time are all we ask of each, which is one round trip on a network share
+    vector<file_stamp> listing;
+    for (auto const &entry: fs::directory_iterator{folder_path}) {
+        string name = entry.path().filename().string();
+        // skip hidden files, our own cache and index live among them
+        if (name.starts_with("."))
+            continue;
+
+        error_code error;
+        uintmax_t size = entry.file_size(error);
+        if (error)
+            continue;
+
+        listing.push_back(file_stamp{name, size, entry.last_write_time(error).time_since_epoch().count()});
+    }
+
+    // file names are the tie breaker when ordering slices
+    sort(listing.begin(), listing.end(), [](const file_stamp &a, const file_stamp &b) {
+        return a.name < b.name;
+    });
+
+    if (use_cache && !deferred) {
+        string cache_path = (fs::path(folder_path) / CACHE_FILE_NAME).string();
+        cache = make_unique<volume_cache>(cache_path, listing_checksum(listing));
+
+        // same files as last time, so we can skip DCMTK entirely
+        if (cache->load()) {
+            cols = cache->get_x();
+            rows = cache->get_y();
+            image_count = cache->get_z();
+            meta_data = cache->get_meta_data();
+            data_ptr = cache->get_data_ptr();
+            timer.set_bytes(sizeof(Uint16) * image_count * rows * cols);
+            return;
+        }
+    }
+
+    register_codecs();
+
+    // headers only, to sort out what belongs to the volume, and in which order
+    vector<slice_header> slices = prescan(folder_path, listing, threads, use_index);
+    if (slices.empty()) {
+        cerr << "No DICOM images in folder: " << folder_path << endl;
+        exit(30);
+    }
+
+    for (const slice_header &slice: slices) {
+        files.push_back(slice.file);
+        pixel_offsets.push_back(slice.pixel_offset);
+    }
+
+    image_count = files.size();
+    cols = slices.front().cols;
+    rows = slices.front().rows;
+    meta_data = slices.front().meta_data;
 
     // this is black magic, and I'm scared
     //Uint16 *** data_ptr = reinterpret_cast<Uint16 ***>(new Uint16[image_count * cols * rows]);
-    data_ptr = new Uint16[image_count * cols * rows];
+    data_ptr = volume_pool::instance().acquire((size_t) image_count * cols * rows);
+    owns_data = true;
+
+    // whoever deferred loading shows the volume while it fills up, so it starts out black
+    if (deferred) {
+        fill(data_ptr, data_ptr + (size_t) image_count * cols * rows, 0);
+        return;
+    }
 
     // load the data from the files into a Mat3D
-    int i = 0;
-    for (string file: files) {
-        if (!fileformat.loadFile(file.data()).good()) {
-            cerr << "Warning: Can't read file: " << file << endl;
-            // exit(1);
-        }
+    vector<size_t> indices(files.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = i;
+
+    load_error error = load_slices(indices, threads, data_ptr);
+    if (error.code) {
+        cerr << error.message << endl;
+        exit(error.code);
+    }
+    timer.set_bytes(sizeof(Uint16) * image_count * rows * cols);
+
+    if (cache) {
+        scoped_timer store_timer("volume_cache::store", sizeof(Uint16) * image_count * rows * cols);
+        if (!cache->store(data_ptr, cols, rows, image_count, meta_data))
+            cerr << "Warning: Can't write volume cache to folder: " << folder_path << endl;
+    }
+}
 
-        ds = fileformat.getDataset();
+load_error dicom::load_slices(const vector<size_t> &indices, unsigned short threads, Uint16 *destination) {
+    scoped_timer timer("dicom::load_slices", sizeof(Uint16) * indices.size() * rows * cols, threads);
+    size_t slice_fields = (size_t) rows * cols;
 
-        const Uint16 *img_ptr;
+    // exiting from a worker would tear down DCMTK under the others, so only the first error is kept
+    mutex error_lock;
+    load_error first;
+    atomic<bool> failed(false);
 
-        // throw on bad status
-        if (!ds->findAndGetUint16Array(DCM_PixelData, img_ptr).good()) {
-            cerr << "Can't read pixel data from file: " << file << endl;
-            exit(6);
-        }
+    for_each_index(indices.size(), threads, [&](DcmFileFormat &fileformat, size_t i) {
+        // once a slice failed, the rest are pointless
+        if (failed.load(memory_order_relaxed))
+            return;
+
+        load_error error = load_slice(fileformat, indices[i], destination + i * slice_fields);
+        if (!error.code)
+            return;
+
+        lock_guard<mutex> guard(error_lock);
+        if (!first.code)
+            first = error;
+        failed = true;
+    });
+
+    return first;
+}
+
+load_error dicom::load_slice(DcmFileFormat &fileformat, size_t index, Uint16 *slice_ptr) {
+    const string &file = files[index];
+    size_t bytes_per_img = sizeof(Uint16) * rows * cols;
 
-        size_t ptr_offset = i++ * rows * cols;
-        memcpy((void *) (data_ptr + ptr_offset), (const void *) img_ptr, bytes_per_img);
+    // the prescan knows where the pixels are, so there's nothing to parse
+    if (pixel_offsets[index] && read_bytes(file, pixel_offsets[index], slice_ptr, bytes_per_img))
+        return {};
+
+    if (!fileformat.loadFile(file.data()).good()) {
+        cerr << "Warning: Can't read file: " << file << endl;
+        // exit(1);
     }
+
+    DcmDataset *ds = fileformat.getDataset();
+
+    DcmXfer xfer(ds->getOriginalXfer());
+    if (xfer.isEncapsulated())
+        return load_compressed_slice(ds, file, xfer, slice_ptr);
+
+    const Uint16 *img_ptr;
+
+    if (!ds->findAndGetUint16Array(DCM_PixelData, img_ptr).good())
+        return {6, "Can't read pixel data from file: " + file};
+
+    memcpy((void *) slice_ptr, (const void *) img_ptr, bytes_per_img);
+    return {};
+}
+
+load_error dicom::load_compressed_slice(DcmDataset *ds, const string &file, const DcmXfer &xfer, Uint16 *slice_ptr) {
+    DcmElement *element;
+    if (!ds->findAndGetElement(DCM_PixelData, element).good())
+        return {6, "Can't read pixel data from file: " + file};
+
+    auto *pixels = OFstatic_cast(DcmPixelData *, element);
+    size_t bytes_per_img = sizeof(Uint16) * rows * cols;
+
+    Uint32 frame_bytes = 0;
+    if (!pixels->getUncompressedFrameSize(ds, frame_bytes).good() || frame_bytes != bytes_per_img)
+        return {27, "The slice in " + file + " isn't " + to_string(cols) + "x" + to_string(rows) + " pixels of 16 bit"};
+
+    // straight into the volume, instead of decompressing the whole dataset and copying
+    Uint32 start_fragment = 0;
+    OFString color_model;
+    OFCondition status = pixels->getUncompressedFrame(ds, 0, start_fragment, slice_ptr, frame_bytes, color_model);
+    if (!status.good())
+        return {28, "Can't decompress " + file + " (" + xfer.getXferName() + "): " + status.text()};
+
+    return {};
 }
 
 dicom::~dicom() {
-    // data is on the heap, so we explicitly delete it, except we don't, because we shared the pointer previously
-    // delete[] data_ptr;
+    // unless someone took it over, the data goes back to the pool,
+    // a mapped cache on the other hand gets unmapped with it
+    if (owns_data)
+        volume_pool::instance().release(data_ptr);
+}
+
+bool dicom::is_cached() const {
+    return cache && cache->is_loaded();
 }
 
 unsigned short *dicom::get_data_ptr() {
     return data_ptr;
 }
 
+bool dicom::is_owning() const {
+    return owns_data;
+}
+
+unsigned short *dicom::release_data_ptr() {
+    if (!owns_data) {
+        cerr << "Can't give away data that this dicom doesn't own" << endl;
+        exit(15);
+    }
+
+    owns_data = false;
+    return data_ptr;
+}
+
 unsigned short dicom::get_image_count() const {
     return image_count;
 }
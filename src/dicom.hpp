@@ -6,20 +6,47 @@
 #define ABGABE_CG_VIS_DICOM_HPP
 
 #include <string>
+#include <vector>
+#include <memory>
 
 #include <dcmtk/dcmdata/dcdatset.h>
 #include <dcmtk/dcmdata/dcfilefo.h>
+#include <dcmtk/dcmdata/dcxfer.h>
+
+#include "volume_cache.hpp"
 
 
 using namespace std;
 
 
+// why slices couldn't be loaded, code is what the program exits with, 0 if they could
+struct load_error {
+    int code = 0;
+    string message;
+};
+
+
 class dicom {
 public:
-    explicit dicom(const string& folder_path);
+    // deferred only reads the headers, and leaves every slice 0 (without a cache), until someone calls load_slices,
+    // the index keeps the headers in the folder, so they are only read again for files that changed
+    explicit dicom(const string& folder_path, unsigned short threads = 1, bool use_cache = false, bool deferred = false,
+                   bool use_index = true);
     ~dicom();
 
+    // loads the slices at the given (sorted) positions into consecutive slices of destination,
+    // safe to call from any thread, as long as the destinations don't overlap,
+    // the first error stops the rest, and exiting is up to the caller, once all workers are done
+    load_error load_slices(const vector<size_t> &indices, unsigned short threads, Uint16 *destination);
+
     unsigned short * get_data_ptr();
+    // if true, the data is mapped from the cache, and must not be deleted
+    bool is_cached() const;
+    // pooled data is ours until someone takes it over, and goes back to the pool with us otherwise
+    bool is_owning() const;
+    // hands the pooled data over to the caller, who has to give it back to the volume pool,
+    // the pointer stays valid for us, as long as the caller keeps it
+    unsigned short *release_data_ptr();
 
     unsigned short get_image_count() const;
     unsigned short get_rows() const;
@@ -35,8 +62,19 @@ public:
     const string &get_meta_data() const;
 
 protected:
+    // these run on the workers, so they don't exit, but report what went wrong
+    load_error load_slice(DcmFileFormat &fileformat, size_t index, Uint16 *slice_ptr);
+    // JPEG, JPEG-LS and RLE, decompressed into the slice of the volume
+    load_error load_compressed_slice(DcmDataset *ds, const string &file, const DcmXfer &xfer, Uint16 *slice_ptr);
+
+    unique_ptr<volume_cache> cache;
+    // in the order of the slices
+    vector<string> files;
+    // where the raw pixels of each slice start, 0 if DCMTK has to read them
+    vector<uint64_t> pixel_offsets;
 
     unsigned short *data_ptr;
+    bool owns_data;
     unsigned short image_count;
     unsigned short rows;
     unsigned short cols;
@@ -0,0 +1,154 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <limits>
+#include <vector>
+#include <functional>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "distance_morphology.hpp"
+
+
+using namespace std;
+
+
+// "far away", big enough that no real squared distance gets there
+static const float FAR = 1e20f;
+
+
+static inline float intersection(const float *f, size_t q, size_t p) {
+    // where the parabolas rooted at q and p cross
+    float fq = (float) q;
+    float fp = (float) p;
+    return ((f[q] + fq * fq) - (f[p] + fp * fp)) / (2.f * fq - 2.f * fp);
+}
+
+static void distance_1d(const float *f, size_t n, float *d, size_t *v, float *z) {
+    // lower envelope of the parabolas rooted at every f[q]
+    const float inf = numeric_limits<float>::infinity();
+    size_t k = 0;
+    v[0] = 0;
+    z[0] = -inf;
+    z[1] = inf;
+
+    for (size_t q = 1; q < n; ++q) {
+        // drop every parabola that the new one hides, z[0] being -inf stops us at the first
+        float s = intersection(f, q, v[k]);
+        while (s <= z[k]) {
+            k--;
+            s = intersection(f, q, v[k]);
+        }
+
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = inf;
+    }
+
+    k = 0;
+    for (size_t q = 0; q < n; ++q) {
+        while (z[k + 1] < (float) q)
+            k++;
+        float dq = (float) q - (float) v[k];
+        d[q] = dq * dq + f[v[k]];
+    }
+}
+
+static void distance_along_axis(float *grid, size_t length, size_t stride, size_t lines,
+                                const function<size_t(size_t)> &line_start) {
+    // every line along the axis is independent, so they get spread over all threads
+    cv::parallel_for_(cv::Range(0, (int) lines), [&](const cv::Range &range) {
+        vector<float> f(length);
+        vector<float> d(length);
+        vector<size_t> v(length);
+        vector<float> z(length + 1);
+
+        for (int line = range.start; line < range.end; ++line) {
+            float *start = grid + line_start(line);
+
+            for (size_t i = 0; i < length; ++i)
+                f[i] = start[i * stride];
+
+            distance_1d(f.data(), length, d.data(), v.data(), z.data());
+
+            for (size_t i = 0; i < length; ++i)
+                start[i * stride] = d[i];
+        }
+    });
+}
+
+void squared_distance_transform(float *grid, size_t cols, size_t rows, size_t slices) {
+    size_t slice_fields = cols * rows;
+
+    // the transform is separable, so we do x, then y, then z
+    distance_along_axis(grid, cols, 1, rows * slices, [cols](size_t line) {
+        return line * cols;
+    });
+
+    distance_along_axis(grid, rows, cols, cols * slices, [cols, slice_fields](size_t line) {
+        return (line / cols) * slice_fields + line % cols;
+    });
+
+    if (slices > 1)
+        distance_along_axis(grid, slices, slice_fields, slice_fields, [](size_t line) {
+            return line;
+        });
+}
+
+
+static void distance_dilate(unsigned short *ptr, size_t fields, size_t cols, size_t rows, size_t slices,
+                            float limit, float *grid) {
+    // everything close enough to something that is set, gets set
+    for (size_t i = 0; i < fields; ++i)
+        grid[i] = *(ptr + i) ? 0.f : FAR;
+
+    squared_distance_transform(grid, cols, rows, slices);
+
+    for (size_t i = 0; i < fields; ++i)
+        *(ptr + i) = (grid[i] <= limit) ? -1 : 0;
+}
+
+static void distance_erode(unsigned short *ptr, size_t fields, size_t cols, size_t rows, size_t slices,
+                           float limit, float *grid) {
+    // everything close enough to something that is not set, gets cleared,
+    // outside of the grid counts as set, like OpenCV's default border
+    for (size_t i = 0; i < fields; ++i)
+        grid[i] = *(ptr + i) ? FAR : 0.f;
+
+    squared_distance_transform(grid, cols, rows, slices);
+
+    for (size_t i = 0; i < fields; ++i)
+        *(ptr + i) = (grid[i] > limit) ? -1 : 0;
+}
+
+void distance_morph(unsigned short *ptr, size_t cols, size_t rows, size_t slices,
+                    int operation, unsigned short brush_size, float *grid) {
+    size_t fields = cols * rows * slices;
+
+    // OpenCV's ellipse of size b rounds its half widths to radius b/2,
+    // comparing against (r + 1/2)^2 is the closest match for a true disk
+    float radius = (float) (brush_size / 2);
+    float limit = radius * radius + radius;
+
+    switch (operation) {
+        case cv::MORPH_ERODE:
+            distance_erode(ptr, fields, cols, rows, slices, limit, grid);
+            break;
+        case cv::MORPH_DILATE:
+            distance_dilate(ptr, fields, cols, rows, slices, limit, grid);
+            break;
+        case cv::MORPH_OPEN:
+            distance_erode(ptr, fields, cols, rows, slices, limit, grid);
+            distance_dilate(ptr, fields, cols, rows, slices, limit, grid);
+            break;
+        case cv::MORPH_CLOSE:
+            distance_dilate(ptr, fields, cols, rows, slices, limit, grid);
+            distance_erode(ptr, fields, cols, rows, slices, limit, grid);
+            break;
+        default:
+            break;
+    }
+}
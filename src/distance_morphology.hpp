@@ -0,0 +1,35 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_DISTANCE_MORPHOLOGY_HPP
+#define ABGABE_CG_VIS_DISTANCE_MORPHOLOGY_HPP
+
+#include <cstddef>
+
+
+// which implementation the morphological operations of an image_stack use
+enum class morphology_engine {
+    // cv::morphologyEx with an elliptical structuring element, slice by slice
+    opencv,
+    // distance transforms with a disk, slice by slice
+    distance_disk,
+    // distance transforms with a ball, over the whole volume
+    distance_sphere,
+};
+
+
+// squared euclidean distance transform in place, grid cells that are 0 are features,
+// everything else ends up as the squared distance to the nearest feature,
+// takes linear time, no matter how far that is (Felzenszwalb & Huttenlocher)
+void squared_distance_transform(float *grid, size_t cols, size_t rows, size_t slices);
+
+// binary morphology on 0/non-zero masks, with the result being 0 or 0xFFFF,
+// operation is one of cv::MORPH_ERODE, cv::MORPH_DILATE, cv::MORPH_OPEN, cv::MORPH_CLOSE,
+// for a single slice the brush is a disk, for more slices it is a ball,
+// grid needs room for cols * rows * slices floats
+void distance_morph(unsigned short *ptr, size_t cols, size_t rows, size_t slices,
+                    int operation, unsigned short brush_size, float *grid);
+
+
+#endif //ABGABE_CG_VIS_DISTANCE_MORPHOLOGY_HPP
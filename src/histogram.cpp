@@ -0,0 +1,149 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <bit>
+#include <algorithm>
+
+#include "histogram.hpp"
+
+
+using namespace std;
+
+
+histogram::histogram(unsigned short shift) :
+    shift(shift),
+    bins(HISTOGRAM_BINS, 0),
+    count(0),
+    zeros(0) {}
+
+unsigned short histogram::shift_for(unsigned short max) {
+    int width = bit_width(max);
+    return (unsigned short) std::max(width - 12, 0);
+}
+
+void histogram::add(const unsigned short *ptr, size_t count) {
+    // the bins are always in cache, so this is about as fast as the loads
+    size_t local_zeros = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned short value = *(ptr + i);
+        bins[value >> shift]++;
+        local_zeros += value == 0;
+    }
+
+    this->count += count;
+    zeros += local_zeros;
+}
+
+void histogram::merge(const histogram &other) {
+    // only bins of the same width can be added up, so the narrower ones get widened
+    if (other.shift < shift) {
+        histogram widened = other;
+        widened.shift_values(0, shift);
+        merge(widened);
+        return;
+    }
+    if (other.shift > shift)
+        shift_values(0, other.shift);
+
+    for (size_t bin = 0; bin < HISTOGRAM_BINS; bin++)
+        bins[bin] += other.bins[bin];
+
+    count += other.count;
+    zeros += other.zeros;
+}
+
+void histogram::shift_values(unsigned short bits, unsigned short new_shift) {
+    // with single value bins, every value knows where it goes,
+    // with wider bins the new ones have to be wider by the same amount, so they map 1:1
+    vector<size_t> shifted(HISTOGRAM_BINS, 0);
+    for (size_t bin = 0; bin < HISTOGRAM_BINS; bin++) {
+        size_t value = (bin << shift) << bits;
+        shifted[std::min(value >> new_shift, HISTOGRAM_BINS - 1)] += bins[bin];
+    }
+
+    bins = std::move(shifted);
+    shift = new_shift;
+}
+
+bool histogram::threshold_values(unsigned short threshold) {
+    size_t first_above = threshold >> shift;
+    if (first_above << shift != threshold)
+        return false;
+
+    size_t above = 0;
+    for (size_t bin = first_above; bin < HISTOGRAM_BINS; bin++)
+        above += bins[bin];
+
+    // everything is 0 or 0xFFFF now
+    fill(bins.begin(), bins.end(), 0);
+    shift = shift_for(-1);
+    bins[0] = count - above;
+    bins[HISTOGRAM_BINS - 1] = above;
+    zeros = count - above;
+    return true;
+}
+
+unsigned short histogram::get_shift() const {
+    return shift;
+}
+
+size_t histogram::get_count() const {
+    return count;
+}
+
+size_t histogram::get_non_zero() const {
+    return count - zeros;
+}
+
+size_t histogram::get_bin(size_t bin) const {
+    return bins[bin];
+}
+
+unsigned short histogram::percentile(double fraction, bool skip_zeros) const {
+    size_t total = skip_zeros ? count - zeros : count;
+    size_t wanted = (size_t) (std::clamp(fraction, 0., 1.) * (double) total);
+
+    size_t seen = 0;
+    for (size_t bin = 0; bin < HISTOGRAM_BINS; bin++) {
+        seen += (skip_zeros && bin == 0) ? bins[bin] - zeros : bins[bin];
+        if (seen > wanted || seen == total)
+            return (unsigned short) (bin << shift);
+    }
+
+    return 0;
+}
+
+unsigned short histogram::otsu_threshold() const {
+    // maximize the variance between the classes below and above the threshold,
+    // w_below * w_above * (mean_below - mean_above)^2, in one sweep over the bins
+    double sum = 0;
+    for (size_t bin = 0; bin < HISTOGRAM_BINS; bin++)
+        sum += (double) bin * (double) bins[bin];
+
+    double weight_below = 0;
+    double sum_below = 0;
+    double best_variance = -1;
+    size_t best_bin = 0;
+
+    for (size_t bin = 0; bin + 1 < HISTOGRAM_BINS; bin++) {
+        weight_below += (double) bins[bin];
+        sum_below += (double) bin * (double) bins[bin];
+
+        double weight_above = (double) count - weight_below;
+        if (weight_below == 0 || weight_above == 0)
+            continue;
+
+        double mean_below = sum_below / weight_below;
+        double mean_above = (sum - sum_below) / weight_above;
+        double variance = weight_below * weight_above * (mean_below - mean_above) * (mean_below - mean_above);
+
+        if (variance > best_variance) {
+            best_variance = variance;
+            best_bin = bin;
+        }
+    }
+
+    // everything above the best bin is foreground
+    return (unsigned short) ((best_bin + 1) << shift);
+}
@@ -0,0 +1,55 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_HISTOGRAM_HPP
+#define ABGABE_CG_VIS_HISTOGRAM_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+
+// 12 bit, like the CT data we get, wider data is binned by its top 12 bits
+static const size_t HISTOGRAM_BINS = 4096;
+
+
+class histogram {
+public:
+    // every bin holds 2^shift consecutive values
+    explicit histogram(unsigned short shift = 0);
+    // the narrowest bins that still fit max
+    static unsigned short shift_for(unsigned short max);
+
+    void add(const unsigned short *ptr, size_t count);
+    void merge(const histogram &other);
+
+    // keep up with image_stack changing its data,
+    // after every value got shifted left by bits, and the stack now needs new_shift
+    void shift_values(unsigned short bits, unsigned short new_shift);
+    // after threshold_data, only works if threshold is the edge of a bin, otherwise returns false
+    bool threshold_values(unsigned short threshold);
+
+    unsigned short get_shift() const;
+    size_t get_count() const;
+    size_t get_non_zero() const;
+    size_t get_bin(size_t bin) const;
+
+    // lowest value of the bin that holds the given fraction of all values,
+    // skip_zeros leaves out the background that masking leaves behind
+    unsigned short percentile(double fraction, bool skip_zeros = false) const;
+    // threshold that best splits the values into two classes (Otsu),
+    // for use with image_stack::threshold_data
+    unsigned short otsu_threshold() const;
+protected:
+    unsigned short shift;
+    vector<size_t> bins;
+    size_t count;
+    // zeros share the first bin with other values, unless the shift is 0
+    size_t zeros;
+};
+
+
+#endif //ABGABE_CG_VIS_HISTOGRAM_HPP
@@ -2,54 +2,311 @@
 // Created by fynn on 20.12.22.
 //
 
+#include <mutex>
+#include <iostream>
+#include <algorithm>
+
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
 #include "image_stack.hpp"
+#include "simd_kernels.hpp"
+#include "distance_morphology.hpp"
 #include "dicom.hpp"
+#include "profiler.hpp"
+#include "volume_pool.hpp"
 
 
 using namespace std;
 
 
+// bounds of the non-zero pixels of one slice, empty slices have first > last
+struct slice_bounds {
+    int first_x;
+    int last_x;
+    int first_y;
+    int last_y;
+};
+
+static bool row_is_zero(const unsigned short *row_ptr, unsigned short cols) {
+    // no early exit within a row, so this vectorizes
+    unsigned short any = 0;
+    for (unsigned short x = 0; x < cols; x++)
+        any |= row_ptr[x];
+    return !any;
+}
+
+static slice_bounds slice_non_zero_bounds(const unsigned short *slice_ptr, unsigned short cols, unsigned short rows) {
+    slice_bounds bounds{cols, -1, rows, -1};
+
+    int first_y = 0;
+    while (first_y < rows && row_is_zero(slice_ptr + (size_t) first_y * cols, cols))
+        first_y++;
+    if (first_y == rows)
+        return bounds;
+
+    int last_y = rows - 1;
+    while (row_is_zero(slice_ptr + (size_t) last_y * cols, cols))
+        last_y--;
+
+    bounds.first_y = first_y;
+    bounds.last_y = last_y;
+
+    // only what's outside of the bounds so far can widen them,
+    // so once a row reached both edges, the others aren't even looked at
+    for (int y = first_y; y <= last_y; y++) {
+        const unsigned short *row_ptr = slice_ptr + (size_t) y * cols;
+
+        for (int x = 0; x < bounds.first_x; x++) {
+            if (row_ptr[x]) {
+                bounds.first_x = x;
+                break;
+            }
+        }
+
+        for (int x = cols - 1; x > bounds.last_x; x--) {
+            if (row_ptr[x]) {
+                bounds.last_x = x;
+                break;
+            }
+        }
+    }
+
+    return bounds;
+}
+
+
+// bricks span whole slices, since morphology works slice by slice,
+// and are about this big, so a handful of them is cheap to keep around
+static const size_t BRICK_BYTES = 4 << 20;
+
+
 image_stack::image_stack(unsigned short *data_ptr,
                          unsigned short x,
                          unsigned short y,
                          unsigned short z,
-                         bool copy)
-        : data_ptr(new unsigned short[fields]),
+                         bool copy,
+                         bool owning)
+        : data_ptr(copy ? volume_pool::instance().acquire(fields) : nullptr),
           cols(x),
           rows(y),
           image_count(z),
-          fields(image_count * rows * cols) {
-    init_stack(data_ptr, copy);
+          fields((size_t) image_count * rows * cols),
+          brick_depth(image_count) {
+    init_stack(data_ptr, copy, owning);
 }
 
 image_stack::image_stack(image_stack &from)
-        : data_ptr(new unsigned short[fields]),
+        : image_stack(from, from.bricks) {}
+
+image_stack::image_stack(image_stack &from, shared_ptr<brick_cache> cache)
+        : data_ptr(nullptr),
           cols(from.get_cols()),
           rows(from.get_rows()),
           image_count(from.get_image_count()),
-          fields(cols * rows * image_count) {
+          fields((size_t) cols * rows * image_count),
+          bricks(std::move(cache)),
+          brick_depth(image_count) {
+
+    init_bricks();
+    if (!bricks && !from.bricks) {
+        // in memory, nothing is copied until one of us writes
+        data_ptr = from.data_ptr;
+        storage = from.storage;
+        copy_statistics(from);
+    } else {
+        if (!bricks) {
+            data_ptr = volume_pool::instance().acquire(fields);
+            storage = make_shared<volume_storage>(data_ptr, true);
+        }
+        copy_from(from);
+    }
+    init_images();
+}
 
-    init_stack(from.data_ptr, true);
+image_stack::image_stack(image_stack &&from) noexcept
+        : cols(from.cols),
+          rows(from.rows),
+          image_count(from.image_count),
+          fields(from.fields),
+          data_ptr(from.data_ptr),
+          storage(std::move(from.storage)),
+          min(from.min),
+          max(from.max),
+          min_max_valid(from.min_max_valid),
+          slice_histograms(std::move(from.slice_histograms)),
+          volume_histogram(std::move(from.volume_histogram)),
+          histograms_valid(from.histograms_valid),
+          images(std::move(from.images)),
+          bricks(std::move(from.bricks)),
+          brick_ids(std::move(from.brick_ids)),
+          brick_depth(from.brick_depth) {
+    // the data stays where it is, so the images still point to it
+    from.data_ptr = nullptr;
+    from.brick_ids.clear();
 }
 
 image_stack::image_stack(dicom &from)
-        : data_ptr(new unsigned short[fields]),
+        : data_ptr(nullptr),
           cols(from.get_cols()),
           rows(from.get_rows()),
           image_count(from.get_image_count()),
-          fields(cols * rows * image_count) {
+          fields((size_t) cols * rows * image_count),
+          brick_depth(image_count) {
+
+    // pooled data is taken over, a mapped cache is only borrowed, so from has to outlive us then
+    bool owning = from.is_owning();
+    init_stack(owning ? from.release_data_ptr() : from.get_data_ptr(), false, owning);
+}
+
+image_stack::image_stack(image_stack &from, Point3D from_corner, Point3D to_corner)
+        : data_ptr(nullptr),
+          cols(to_corner.x - from_corner.x + 1),
+          rows(to_corner.y - from_corner.y + 1),
+          image_count(to_corner.z - from_corner.z + 1),
+          fields((size_t) cols * rows * image_count),
+          brick_depth(image_count) {
+    if (to_corner.x < from_corner.x || to_corner.y < from_corner.y || to_corner.z < from_corner.z
+        || from.cols <= to_corner.x || from.rows <= to_corner.y || from.image_count <= to_corner.z) {
+        cerr << "Can't crop outside of the image stack" << endl;
+        exit(25);
+    }
+
+    scoped_timer timer("image_stack::crop", sizeof(unsigned short) * fields);
+    data_ptr = volume_pool::instance().acquire(fields);
+    storage = make_shared<volume_storage>(data_ptr, true);
+    size_t from_slice_fields = (size_t) from.rows * from.cols;
+
+    from.for_each_slab([&](unsigned short *slab_ptr, unsigned short first, unsigned short count) {
+        for (unsigned short i = 0; i < count; i++) {
+            unsigned short z = first + i;
+            if (z < from_corner.z || to_corner.z < z)
+                continue;
 
-    init_stack(from.get_data_ptr(), true);
+            const unsigned short *slice_ptr = slab_ptr + i * from_slice_fields;
+            for (unsigned short y = 0; y < rows; y++) {
+                const unsigned short *row_ptr = slice_ptr + (size_t) (from_corner.y + y) * from.cols + from_corner.x;
+                memcpy((void *) ptr_to(0, y, z - from_corner.z), (const void *) row_ptr, sizeof(unsigned short) * cols);
+            }
+        }
+    }, false);
+
+    invalidate_statistics();
+    init_images();
 }
 
 image_stack::~image_stack() {
-    // in the end, we have to free up the data
-    // TODO just deleting the pointer is probably not enough, checkout free?
-    delete[] data_ptr;
+    // the data goes back to the pool with the last stack holding it
+    for (size_t brick: brick_ids)
+        bricks->discard(brick);
+}
+
+void image_stack::init_bricks() {
+    if (!bricks)
+        return;
+
+    // every brick has the same size, the last one just uses fewer slices
+    size_t slice_bytes = sizeof(unsigned short) * rows * cols;
+    brick_depth = (unsigned short) std::clamp(BRICK_BYTES / slice_bytes, (size_t) 1, (size_t) image_count);
+
+    size_t brick_count = (image_count + brick_depth - 1) / brick_depth;
+    for (size_t i = 0; i < brick_count; ++i)
+        brick_ids.push_back(bricks->allocate(slice_bytes * brick_depth));
+}
+
+bool image_stack::is_bricked() const {
+    return (bool) bricks;
+}
+
+unsigned short *image_stack::acquire_slices(unsigned short first, bool writes) const {
+    // first has to be the start of a slab
+    if (!bricks)
+        return data_ptr + (size_t) first * rows * cols;
+
+    return bricks->acquire(brick_ids[first / brick_depth], writes);
+}
+
+void image_stack::release_slices(unsigned short first) const {
+    if (bricks)
+        bricks->release(brick_ids[first / brick_depth]);
+}
+
+void image_stack::for_each_slab(const slab_function &fn, bool writes) {
+    if (writes)
+        make_writable();
+
+    // in memory, the whole volume is one big slab
+    for (unsigned short first = 0; first < image_count; first += brick_depth) {
+        unsigned short count = std::min<unsigned short>(brick_depth, image_count - first);
+        unsigned short *ptr = acquire_slices(first, writes);
+        fn(ptr, first, count);
+        release_slices(first);
+    }
+}
+
+void image_stack::for_each_slab(const image_stack &other, const binary_slab_function &fn, bool writes) {
+    if (cols != other.cols || rows != other.rows || image_count != other.image_count) {
+        cerr << "Can't combine image stacks of different dimensions" << endl;
+        exit(13);
+    }
+
+    if (writes)
+        make_writable();
+
+    // slabs have to line up with the bricks of whoever has some
+    unsigned short depth = std::min(brick_depth, other.brick_depth);
+
+    for (unsigned short first = 0; first < image_count; first += depth) {
+        unsigned short count = std::min<unsigned short>(depth, image_count - first);
+        unsigned short *ptr = acquire_slices(first, writes);
+        unsigned short *other_ptr = other.acquire_slices(first, false);
+        fn(ptr, other_ptr, first, count);
+        other.release_slices(first);
+        release_slices(first);
+    }
+}
+
+void image_stack::copy_from(const image_stack &other) {
+    scoped_timer timer("image_stack::copy_from", sizeof(unsigned short) * fields);
+    size_t slice_fields = (size_t) rows * cols;
+    // everything gets overwritten, so a shared buffer isn't worth copying first
+    make_writable(false);
+
+    for_each_slab(other, [slice_fields](unsigned short *ptr, unsigned short *other_ptr,
+                                        unsigned short, unsigned short count) {
+        memcpy((void *) ptr, (const void *) other_ptr, sizeof(unsigned short) * slice_fields * count);
+    });
+
+    // same data, same statistics
+    copy_statistics(other);
+}
+
+void image_stack::copy_statistics(const image_stack &other) {
+    min = other.min;
+    max = other.max;
+    min_max_valid = other.min_max_valid;
+    slice_histograms = other.slice_histograms;
+    volume_histogram = other.volume_histogram;
+    histograms_valid = other.histograms_valid;
+}
+
+void image_stack::make_writable(bool keep_data) {
+    // bricks are copied up front, and data nobody else holds can be written right away
+    if (bricks || !storage || storage.use_count() == 1)
+        return;
+
+    unsigned short *copy_ptr = volume_pool::instance().acquire(fields);
+    if (keep_data) {
+        scoped_timer timer("image_stack::copy_on_write", sizeof(unsigned short) * fields);
+        memcpy((void *) copy_ptr, (const void *) data_ptr, sizeof(unsigned short) * fields);
+    }
+
+    // the others keep the old buffer, and the images have to follow us to the new one
+    storage = make_shared<volume_storage>(copy_ptr, true);
+    data_ptr = copy_ptr;
+    images.clear();
+    init_images();
 }
 
 void image_stack::copy_data(const unsigned short *ptr) {
@@ -59,71 +316,159 @@ void image_stack::copy_data(const unsigned short *ptr) {
 }
 
 void image_stack::init_images() {
+    // bricks move around, so there is nothing stable to point to
+    if (bricks)
+        return;
+
     // for every image, we generate a row x col matrix,
     // with the data argument pointing to the first element in our data
-    for (unsigned short i; i < get_image_count(); i++) {
+    for (unsigned short i = 0; i < get_image_count(); i++) {
         unsigned short *ptr = ptr_to(0, 0, i);
-        images.emplace_back(rows, cols, CV_16UC1, ptr, sizeof(unsigned short) * rows);
+        images.emplace_back(rows, cols, CV_16UC1, ptr, sizeof(unsigned short) * cols);
     }
 }
 
-void image_stack::morph_stack(unsigned short operation, unsigned short brush_size) {
+void image_stack::morph_stack(unsigned short operation, unsigned short brush_size, morphology_engine engine) {
     // helper for morphing every image in the stack inplace
+    size_t slice_fields = (size_t) rows * cols;
+
+    if (engine == morphology_engine::distance_sphere) {
+        // a ball reaches across slices, so it needs all of them at once
+        if (bricks) {
+            cerr << "Morphology with a spherical brush needs the whole stack in memory" << endl;
+            exit(17);
+        }
 
-    // generate a structuring element with the right size
+        make_writable();
+        // the grid is twice the size of the volume, so it's worth keeping for the next one
+        float *grid = volume_pool::instance().acquire_floats(fields);
+        distance_morph(data_ptr, cols, rows, image_count, operation, brush_size, grid);
+        volume_pool::instance().release(grid);
+        invalidate_statistics();
+        return;
+    }
+
+    // generate a structuring element with the right size, once for all slices
     cv::Size size(brush_size, brush_size);
-    // for all image_count, we do the appropriate transformation
-    for (auto image: images)
-        cv::morphologyEx(image, image, operation, cv::getStructuringElement(cv::MORPH_ELLIPSE, size));
+    cv::Mat element = cv::getStructuringElement(cv::MORPH_ELLIPSE, size);
+
+    // for all image_count, we do the appropriate transformation,
+    // slices don't depend on each other, so they are spread over all threads
+    for_each_slab([&](unsigned short *ptr, unsigned short, unsigned short count) {
+        cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+            vector<float> grid;
+            if (engine == morphology_engine::distance_disk)
+                grid.resize(slice_fields);
+
+            for (int i = range.start; i < range.end; ++i) {
+                unsigned short *slice_ptr = ptr + i * slice_fields;
+                morph_slice(slice_ptr, operation, element, brush_size, engine, grid.data());
+            }
+        });
+    });
+
+    // min and max might have changed, but that can wait until someone asks
+    invalidate_statistics();
+}
+
+void image_stack::morph_slice(unsigned short *slice_ptr, unsigned short operation, const cv::Mat &element,
+                              unsigned short brush_size, morphology_engine engine, float *grid) const {
+    if (engine == morphology_engine::distance_disk) {
+        distance_morph(slice_ptr, cols, rows, 1, operation, brush_size, grid);
+        return;
+    }
 
-    // min and max might have changed
-    establish_min_max();
+    cv::Mat image(rows, cols, CV_16UC1, slice_ptr, sizeof(unsigned short) * cols);
+    cv::morphologyEx(image, image, operation, element);
 }
 
-void image_stack::open_stack(unsigned short brush_size) {
-    morph_stack(cv::MORPH_OPEN, brush_size);
+void image_stack::open_stack(unsigned short brush_size, morphology_engine engine) {
+    scoped_timer timer("image_stack::open_stack", sizeof(unsigned short) * fields, cv::getNumThreads());
+    morph_stack(cv::MORPH_OPEN, brush_size, engine);
 }
 
-void image_stack::close_stack(unsigned short brush_size) {
-    morph_stack(cv::MORPH_CLOSE, brush_size);
+void image_stack::close_stack(unsigned short brush_size, morphology_engine engine) {
+    scoped_timer timer("image_stack::close_stack", sizeof(unsigned short) * fields, cv::getNumThreads());
+    morph_stack(cv::MORPH_CLOSE, brush_size, engine);
 }
 
-void image_stack::dilate_stack(unsigned short brush_size) {
-    morph_stack(cv::MORPH_DILATE, brush_size);
+void image_stack::dilate_stack(unsigned short brush_size, morphology_engine engine) {
+    scoped_timer timer("image_stack::dilate_stack", sizeof(unsigned short) * fields, cv::getNumThreads());
+    morph_stack(cv::MORPH_DILATE, brush_size, engine);
 }
 
-void image_stack::erode_stack(unsigned short brush_size) {
-    morph_stack(cv::MORPH_ERODE, brush_size);
+void image_stack::erode_stack(unsigned short brush_size, morphology_engine engine) {
+    scoped_timer timer("image_stack::erode_stack", sizeof(unsigned short) * fields, cv::getNumThreads());
+    morph_stack(cv::MORPH_ERODE, brush_size, engine);
 }
 
 void image_stack::operator&(const image_stack& other) {
     // A & B changes A inplace, by doing an element wise and
-    unsigned short* ptr = data_ptr;
-    unsigned short* other_ptr = other.data_ptr;
-    unsigned short* end_ptr = data_ptr + fields;
+    scoped_timer timer("image_stack::operator&", sizeof(unsigned short) * fields);
+    size_t slice_fields = (size_t) rows * cols;
+    unsigned short local_min = -1;
+    unsigned short local_max = 0;
 
-    while (ptr < end_ptr)
-        *(ptr) = *(ptr++) & *(other_ptr++);
+    for_each_slab(other, [&](unsigned short *ptr, unsigned short *other_ptr,
+                             unsigned short, unsigned short count) {
+        active_kernels().bitwise_and(ptr, other_ptr, slice_fields * count);
+        // min and max might have changed, and the slab is still hot
+        active_kernels().min_max(ptr, slice_fields * count, local_min, local_max);
+    });
 
-    // min and max might have changed
-    establish_min_max();
-    // TODO we could do optimization here,
-    //  if other.min ==  0, then min becomes 0
-    //  if other.max == -1, then max stays the same
-    //  if min ==  0, then it will still be zero
-    //  if max ==  0, then it will still be zero
+    invalidate_statistics();
+    min = local_min;
+    max = local_max;
+    min_max_valid = true;
+}
+
+void image_stack::operator&(const bit_mask& mask) {
+    // same as with a stack, but the mask only has one bit for every voxel
+    scoped_timer timer("image_stack::operator&(bit_mask)", sizeof(unsigned short) * fields, cv::getNumThreads());
+    if (cols != mask.get_x() || rows != mask.get_y() || image_count != mask.get_z()) {
+        cerr << "Can't combine image stacks of different dimensions" << endl;
+        exit(13);
+    }
+
+    size_t slice_fields = (size_t) rows * cols;
+    const simd_kernels &kernels = active_kernels();
+    unsigned short local_min = -1;
+    unsigned short local_max = 0;
+
+    for_each_slab([&](unsigned short *slab_ptr, unsigned short first, unsigned short count) {
+        cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++)
+                for (unsigned short y = 0; y < rows; y++)
+                    kernels.and_bits(slab_ptr + i * slice_fields + (size_t) y * cols, cols,
+                                     mask.row_at(y, first + i));
+        });
+        // min and max might have changed, and the slab is still hot
+        kernels.min_max(slab_ptr, slice_fields * count, local_min, local_max);
+    });
+
+    invalidate_statistics();
+    min = local_min;
+    max = local_max;
+    min_max_valid = true;
 }
 
 void image_stack::operator|(const image_stack& other) {
     // A | B changes A inplace, by doing an element wise or
-    unsigned short* ptr = data_ptr;
-    unsigned short* other_ptr = other.data_ptr;
-    unsigned short* end_ptr = data_ptr + fields;
+    scoped_timer timer("image_stack::operator|", sizeof(unsigned short) * fields);
+    size_t slice_fields = (size_t) rows * cols;
+    unsigned short local_min = -1;
+    unsigned short local_max = 0;
 
-    while (ptr < end_ptr)
-        *(ptr) = *(ptr++) | *(other_ptr++);
+    for_each_slab(other, [&](unsigned short *ptr, unsigned short *other_ptr,
+                             unsigned short, unsigned short count) {
+        active_kernels().bitwise_or(ptr, other_ptr, slice_fields * count);
+        active_kernels().min_max(ptr, slice_fields * count, local_min, local_max);
+    });
 
-    establish_min_max();
+    invalidate_statistics();
+    min = local_min;
+    max = local_max;
+    min_max_valid = true;
 }
 
 unsigned short *image_stack::ptr_to(unsigned short x, unsigned short y, unsigned short z) {
@@ -131,12 +476,20 @@ unsigned short *image_stack::ptr_to(unsigned short x, unsigned short y, unsigned
 }
 
 unsigned short image_stack::get_at(unsigned short x, unsigned short y, unsigned short z) {
-    return *(ptr_to(x, y, z));
+    // find the slab the point lives in, for in memory stacks that's all of it
+    unsigned short first = z - z % brick_depth;
+    unsigned short value = acquire_slices(first, false)[((size_t) (z - first) * rows + y) * cols + x];
+    release_slices(first);
+    return value;
 }
 
 void image_stack::set_at(unsigned short x, unsigned short y, unsigned short z, unsigned short new_value) {
-    *ptr_to(x, y, z) = new_value;
+    make_writable();
+    unsigned short first = z - z % brick_depth;
+    acquire_slices(first, true)[((size_t) (z - first) * rows + y) * cols + x] = new_value;
+    release_slices(first);
 
+    histograms_valid = false;
     min = (new_value < min) ? new_value : min;
     max = (new_value > max) ? new_value : max;
 }
@@ -166,28 +519,50 @@ unsigned short image_stack::get_x() const {
 }
 
 void image_stack::show_at(unsigned short image_index, int delay) {
+    // imshow only reads, so the view may stay shared
     cv::imshow("OpenCV", images[image_index]);
     cv::waitKey(delay);
     cv::destroyWindow("OpenCV");
 }
 
 cv::Mat image_stack::image_at(unsigned short image_index) {
-    return images[image_index];
+    // whoever gets the view might write through it, like with get_data_ptr
+    if (!bricks) {
+        make_writable();
+        return images[image_index];
+    }
+
+    // the brick may be paged out any time, so hand out a copy
+    unsigned short first = image_index - image_index % brick_depth;
+    unsigned short *ptr = acquire_slices(first, false) + (size_t) (image_index - first) * rows * cols;
+    cv::Mat image = cv::Mat(rows, cols, CV_16UC1, ptr, sizeof(unsigned short) * cols).clone();
+    release_slices(first);
+    return image;
 }
 
 void image_stack::normalize_data() {
     // feature scaling
     // x' = round(((x-min) / (max-min)) * max_possible)
+    scoped_timer timer("image_stack::normalize_data", sizeof(unsigned short) * fields);
+
+    ensure_min_max();
 
     unsigned short max_possible = -1;
     size_t range = max != min ? max - min : 1;
-    double scaling_factor = max_possible / range;
+    // integer division, so the factor is whole and (x-min) * factor never leaves 16 bit
+    unsigned short scaling_factor = max_possible / range;
+
+    size_t slice_fields = (size_t) rows * cols;
+    unsigned short local_min = min;
 
-    for (int i = 0; i < fields; ++i)
-        *(data_ptr + i) = (unsigned short) round((*(data_ptr + i) - min) * scaling_factor);
+    for_each_slab([&](unsigned short *ptr, unsigned short, unsigned short count) {
+        active_kernels().scale(ptr, slice_fields * count, local_min, scaling_factor);
+    });
 
+    // the largest value is still the largest, just scaled
+    max = (max - min) * scaling_factor;
     min = 0;
-    max = max != min ? -1 : 0;
+    histograms_valid = false;
 }
 
 void image_stack::normalize_pseudo_hounsfield() {
@@ -197,47 +572,142 @@ void image_stack::normalize_pseudo_hounsfield() {
     // our "hounsfield" data is 12 bit,
     // and we want to project to 16 bit,
     // so we just multiply by 2^4 = 16
+    scoped_timer timer("image_stack::normalize_pseudo_hounsfield", sizeof(unsigned short) * fields);
+
+    size_t slice_fields = (size_t) rows * cols;
 
-    for (int i = 0; i < fields; ++i)
-        *(data_ptr + i) << 4;
+    // whether anything overflows is up to the values before the shift
+    ensure_min_max();
+    bool overflows = max > 0x0FFF;
 
-    establish_min_max();
+    for_each_slab([slice_fields](unsigned short *ptr, unsigned short, unsigned short count) {
+        active_kernels().shift_left(ptr, slice_fields * count, 4);
+    });
+
+    // if nothing overflowed, the statistics just move along
+    if (overflows) {
+        invalidate_statistics();
+        return;
+    }
+
+    min <<= 4;
+    max <<= 4;
+
+    if (histograms_valid) {
+        unsigned short shift = histogram::shift_for(max);
+        for (histogram &slice_histogram : slice_histograms)
+            slice_histogram.shift_values(4, shift);
+        volume_histogram.shift_values(4, shift);
+    }
 }
 
 void image_stack::establish_min_max() {
     // find min and max in our data
+    scoped_timer timer("image_stack::establish_min_max", sizeof(unsigned short) * fields);
     unsigned short local_min = -1;
     unsigned short local_max = 0;
 
-    for (int i = 0; i < fields; ++i) {
-        unsigned short val = *(data_ptr + i);
-        local_min = (val < local_min) ? val : local_min;
-        local_max = (val > local_max) ? val : local_max;
-    }
+    size_t slice_fields = (size_t) rows * cols;
+
+    for_each_slab([&](unsigned short *ptr, unsigned short, unsigned short count) {
+        active_kernels().min_max(ptr, slice_fields * count, local_min, local_max);
+    }, false);
 
     min = local_min;
     max = local_max;
+    min_max_valid = true;
+}
+
+void image_stack::ensure_min_max() {
+    if (!min_max_valid)
+        establish_min_max();
+}
+
+void image_stack::establish_histograms() {
+    scoped_timer timer("image_stack::establish_histograms", sizeof(unsigned short) * fields, cv::getNumThreads());
+    // all slices use the bins of the volume, so they can be added up
+    unsigned short shift = histogram::shift_for(get_max());
+    size_t slice_fields = (size_t) rows * cols;
+
+    slice_histograms.assign(image_count, histogram(shift));
+
+    for_each_slab([&](unsigned short *ptr, unsigned short first, unsigned short count) {
+        cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++)
+                slice_histograms[first + i].add(ptr + i * slice_fields, slice_fields);
+        });
+    }, false);
+
+    volume_histogram = histogram(shift);
+    for (const histogram &slice_histogram : slice_histograms)
+        volume_histogram.merge(slice_histogram);
+
+    histograms_valid = true;
 }
 
-void image_stack::init_stack(unsigned short *ptr, bool copy) {
+void image_stack::invalidate_statistics() {
+    min_max_valid = false;
+    histograms_valid = false;
+}
+
+unsigned short image_stack::get_min() {
+    ensure_min_max();
+    return min;
+}
+
+unsigned short image_stack::get_max() {
+    ensure_min_max();
+    return max;
+}
+
+size_t image_stack::count_non_zero() {
+    return get_histogram().get_non_zero();
+}
+
+const histogram &image_stack::get_histogram() {
+    if (!histograms_valid)
+        establish_histograms();
+    return volume_histogram;
+}
+
+const histogram &image_stack::get_slice_histogram(unsigned short image_index) {
+    if (!histograms_valid)
+        establish_histograms();
+    return slice_histograms[image_index];
+}
+
+void image_stack::init_stack(unsigned short *ptr, bool copy, bool owning) {
     if (copy)
         copy_data(ptr);
     else
         data_ptr = ptr;
+    storage = make_shared<volume_storage>(data_ptr, copy || owning);
 
-    establish_min_max();
+    invalidate_statistics();
     init_images();
 }
 
 void image_stack::threshold_data(unsigned short threshold) {
-    for (int i = 0; i < fields; ++i)
-        *(data_ptr + i) = (*(data_ptr + i) < threshold) ? 0 : -1;
+    scoped_timer timer("image_stack::threshold_data", sizeof(unsigned short) * fields);
+    size_t slice_fields = (size_t) rows * cols;
+
+    for_each_slab([slice_fields, threshold](unsigned short *ptr, unsigned short, unsigned short count) {
+        active_kernels().threshold(ptr, slice_fields * count, threshold);
+    });
+
+    // everything under the threshold is 0, everything else 0xFFFF,
+    // so if we knew where min and max were, we know where they went
+    if (min_max_valid) {
+        min = (min >= threshold) ? -1 : 0;
+        max = (max >= threshold) ? -1 : 0;
+    }
 
-    min = 0;
-    max = -1;
-    // TODO not necessarily true
-    //  if everything is under the threshold max is 0 and
-    //  vice versa for min if everything is over threshold
+    // same for the histograms, if the threshold doesn't cut through a bin
+    if (histograms_valid) {
+        histograms_valid = volume_histogram.threshold_values(threshold);
+        for (histogram &slice_histogram : slice_histograms)
+            histograms_valid = histograms_valid && slice_histogram.threshold_values(threshold);
+    }
 }
 
 void image_stack::mask_roi(Point2D from, Point2D to) {
@@ -249,51 +719,198 @@ void image_stack::mask_roi(Point2D from, Point2D to) {
 void image_stack::mask_roi(Point3D from, Point3D to) {
     // clean all points that are under from, or over to
     // this can probably be done much nicer, but it's somewhat optimized
+    scoped_timer timer("image_stack::mask_roi", sizeof(unsigned short) * fields);
 
     // you could calculate the dimension with the most "cutaway",
     // and put that in the lowest loop to maximize savings
 
-    // iterate over images
-    for (unsigned short z = 0; z < image_count; z++) {
-        // if z is oob, then xy don't matter
-        if (z < from.z || to.z < z) {
-            // so we set this whole image zero
-            for (int i = 0; i < rows; ++i)
-                for (int j = 0; j < cols; ++j)
-                    set_at(j, i, z, 0);
+    size_t slice_fields = (size_t) rows * cols;
 
-            // and go to the next image
-            continue;
-        }
+    unsigned short local_min = -1;
+    unsigned short local_max = 0;
 
-        // iterate over rows
-        for (unsigned short y = 0; y < rows; y++) {
-            // if y is oob, then x doesn't matter
-            if (y < from.y || to.y < y) {
-                // so we set this whole row zero
-                for (int i = 0; i < cols; ++i)
-                    set_at(i, y, z, 0);
+    // iterate over images, a slab at a time
+    for_each_slab([&](unsigned short *slab_ptr, unsigned short first, unsigned short count) {
+        for (unsigned short i = 0; i < count; i++)
+            mask_slice_roi(slab_ptr + i * slice_fields, first + i, from, to);
 
-                // and go to the next row
-                continue;
-            }
+        // min and max might have changed, and the slab is still hot
+        active_kernels().min_max(slab_ptr, slice_fields * count, local_min, local_max);
+    });
+
+    invalidate_statistics();
+    min = local_min;
+    max = local_max;
+    min_max_valid = true;
+}
+
+bool image_stack::non_zero_bounds(Point3D &from, Point3D &to) {
+    scoped_timer timer("image_stack::non_zero_bounds", sizeof(unsigned short) * fields, cv::getNumThreads());
+    size_t slice_fields = (size_t) rows * cols;
+    vector<slice_bounds> bounds(image_count, slice_bounds{cols, -1, rows, -1});
 
-            // iterate over pixels
-            for (unsigned short x = 0; x < cols; x++) {
-                // if x is oob, then we set it to zero
-                if (x < from.x || to.x < x) {
-                    set_at(x, y, z, 0);
+    for_each_slab([&](unsigned short *slab_ptr, unsigned short first, unsigned short count) {
+        cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                // the histograms already know which slices are empty
+                if (histograms_valid && !slice_histograms[first + i].get_non_zero())
                     continue;
-                }
+                bounds[first + i] = slice_non_zero_bounds(slab_ptr + i * slice_fields, cols, rows);
             }
+        });
+    }, false);
+
+    slice_bounds total{cols, -1, rows, -1};
+    int first_z = image_count;
+    int last_z = -1;
+
+    for (int z = 0; z < image_count; z++) {
+        if (bounds[z].last_y < 0)
+            continue;
+
+        first_z = std::min(first_z, z);
+        last_z = z;
+        total.first_x = std::min(total.first_x, bounds[z].first_x);
+        total.last_x = std::max(total.last_x, bounds[z].last_x);
+        total.first_y = std::min(total.first_y, bounds[z].first_y);
+        total.last_y = std::max(total.last_y, bounds[z].last_y);
+    }
+
+    if (last_z < 0)
+        return false;
+
+    from = Point3D{(unsigned short) total.first_x, (unsigned short) total.first_y, (unsigned short) first_z};
+    to = Point3D{(unsigned short) total.last_x, (unsigned short) total.last_y, (unsigned short) last_z};
+    return true;
+}
+
+void image_stack::mask_slice_roi(unsigned short *slice_ptr, unsigned short z, Point3D from, Point3D to) const {
+    size_t slice_fields = (size_t) rows * cols;
+
+    // if z is oob, then xy don't matter
+    if (z < from.z || to.z < z) {
+        // so we set this whole image zero
+        fill(slice_ptr, slice_ptr + slice_fields, 0);
+        return;
+    }
+
+    // iterate over rows
+    for (unsigned short y = 0; y < rows; y++) {
+        unsigned short *row_ptr = slice_ptr + y * cols;
+
+        // if y is oob, then x doesn't matter
+        if (y < from.y || to.y < y) {
+            // so we set this whole row zero
+            fill(row_ptr, row_ptr + cols, 0);
+
+            // and go to the next row
+            continue;
         }
+
+        // if x is oob, then we set it to zero
+        fill(row_ptr, row_ptr + std::min<size_t>(from.x, cols), 0);
+        if (to.x < cols)
+            fill(row_ptr + to.x + 1, row_ptr + cols, 0);
     }
+}
+
+void image_stack::apply_mask_pipeline(const mask_parameters &params) {
+    // does the same as copying the stack into a mask, running threshold_data, mask_roi,
+    // open_stack, close_stack and dilate_stack on that, and finally masking with &,
+    // but a slice at a time, so every slice goes through all steps while it's in cache
+    scoped_timer timer("image_stack::apply_mask_pipeline", sizeof(unsigned short) * fields, cv::getNumThreads());
+    size_t slice_fields = (size_t) rows * cols;
+
+    if (params.engine == morphology_engine::distance_sphere) {
+        cerr << "The fused pipeline works slice by slice, so it can't use a spherical brush" << endl;
+        exit(18);
+    }
+
+    Point3D from{params.roi_from.x, params.roi_from.y, 0};
+    Point3D to{params.roi_to.x, params.roi_to.y, get_z()};
+
+    cv::Mat open_element = cv::getStructuringElement(cv::MORPH_ELLIPSE,
+                                                     cv::Size(params.open_brush, params.open_brush));
+    cv::Mat close_element = cv::getStructuringElement(cv::MORPH_ELLIPSE,
+                                                      cv::Size(params.close_brush, params.close_brush));
+    cv::Mat dilate_element = cv::getStructuringElement(cv::MORPH_ELLIPSE,
+                                                       cv::Size(params.dilate_brush, params.dilate_brush));
+
+    const simd_kernels &kernels = active_kernels();
+    unsigned short local_min = -1;
+    unsigned short local_max = 0;
+    mutex min_max_lock;
+
+    for_each_slab([&](unsigned short *slab_ptr, unsigned short first, unsigned short count) {
+        // every thread works on its own slices, with its own mask
+        cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+            // the mask only ever needs to hold one slice
+            vector<unsigned short> mask_data(slice_fields);
+            unsigned short *mask_ptr = mask_data.data();
+
+            vector<float> grid;
+            if (params.engine == morphology_engine::distance_disk)
+                grid.resize(slice_fields);
+
+            unsigned short range_min = -1;
+            unsigned short range_max = 0;
+
+            for (int i = range.start; i < range.end; i++) {
+                unsigned short *slice_ptr = slab_ptr + i * slice_fields;
+
+                memcpy((void *) mask_ptr, (const void *) slice_ptr, sizeof(unsigned short) * slice_fields);
+                kernels.threshold(mask_ptr, slice_fields, params.threshold);
+
+                if (params.has_roi)
+                    mask_slice_roi(mask_ptr, first + i, from, to);
+
+                morph_slice(mask_ptr, cv::MORPH_OPEN, open_element, params.open_brush, params.engine, grid.data());
+                morph_slice(mask_ptr, cv::MORPH_CLOSE, close_element, params.close_brush, params.engine, grid.data());
+                morph_slice(mask_ptr, cv::MORPH_DILATE, dilate_element, params.dilate_brush, params.engine,
+                            grid.data());
+
+                // masking, and keeping track of min and max while the slice is still hot
+                kernels.bitwise_and(slice_ptr, mask_ptr, slice_fields);
+                kernels.min_max(slice_ptr, slice_fields, range_min, range_max);
+            }
+
+            lock_guard<mutex> guard(min_max_lock);
+            local_min = (range_min < local_min) ? range_min : local_min;
+            local_max = (range_max > local_max) ? range_max : local_max;
+        });
+    });
 
-    // min and max might have changed
-    establish_min_max();
+    invalidate_statistics();
+    min = local_min;
+    max = local_max;
+    min_max_valid = true;
 }
 
 unsigned short *image_stack::get_data_ptr() {
+    if (bricks) {
+        cerr << "Bricked image stacks have no contiguous data, copy them into memory first" << endl;
+        exit(14);
+    }
+
+    // whoever gets the pointer might write through it
+    make_writable();
+    return data_ptr;
+}
+
+bool image_stack::is_owning() const {
+    return storage && storage->owning && !bricks;
+}
+
+unsigned short *image_stack::release_data_ptr() {
+    if (!is_owning()) {
+        cerr << "Can't give away data that this image stack doesn't own" << endl;
+        exit(15);
+    }
+
+    // the pointer stays valid for us, but freeing it is someone else's job now,
+    // so no other stack may hold on to it
+    make_writable();
+    storage->owning = false;
     return data_ptr;
 }
 
@@ -6,10 +6,31 @@
 #define ABGABE_CG_VIS_IMAGE_STACK_HPP
 
 #include <vector>
+#include <memory>
+#include <functional>
 #include <opencv2/core.hpp>
 
 #include "dicom.hpp"
+#include "brick_cache.hpp"
+#include "distance_morphology.hpp"
+#include "bit_mask.hpp"
+#include "histogram.hpp"
 #include "convenience.hpp"
+#include "volume_pool.hpp"
+
+
+// parameters for cleaning a stack with a mask made from itself,
+// see image_stack::apply_mask_pipeline
+struct mask_parameters {
+    unsigned short threshold;
+    bool has_roi;
+    Point2D roi_from;
+    Point2D roi_to;
+    unsigned short open_brush;
+    unsigned short close_brush;
+    unsigned short dilate_brush;
+    morphology_engine engine;
+};
 
 
 class image_stack {
@@ -18,21 +39,45 @@ public:
                 unsigned short x,
                 unsigned short y,
                 unsigned short z,
-                bool copy = true);
+                bool copy = true,
+                bool owning = true);
 
+    // in memory, stacks share their data, until one of them writes to it
     image_stack(image_stack &from);
+    // copies into a stack that is paged through cache, or shares the data in memory if cache is null
+    image_stack(image_stack &from, shared_ptr<brick_cache> cache);
+    // takes over the data and bricks, from is empty afterwards
+    image_stack(image_stack &&from) noexcept;
+    // takes over the data of from, or borrows it, if it's mapped from the cache
     explicit image_stack(dicom &from);
+    // copies the box between the corners (both included) into a new stack in memory
+    image_stack(image_stack &from, Point3D from_corner, Point3D to_corner);
     ~image_stack();
 
+    // stacks never change their size, so there's nothing to assign
+    image_stack &operator=(const image_stack &) = delete;
+    image_stack &operator=(image_stack &&) = delete;
+
+    // copies the data of a stack with the same dimensions
+    void copy_from(const image_stack &other);
+    bool is_bricked() const;
+
     // elementwise masking
     void operator&(const image_stack& other);
     void operator|(const image_stack& other);
+    // clears every voxel whose bit isn't set
+    void operator&(const bit_mask& mask);
 
     // getter/setter
+    // the data is ours alone afterwards, so it may be written to
     unsigned short *get_data_ptr();
+    // hands the data over to the caller, who has to give it back to the volume pool
+    unsigned short *release_data_ptr();
+    bool is_owning() const;
     inline unsigned short get_at(unsigned short x, unsigned short y, unsigned short z);
     inline void set_at(unsigned short x, unsigned short y, unsigned short z, unsigned short new_value);
     void show_at(unsigned short image_index, int delay = 0);
+    // a view of the slice in memory, which is ours alone afterwards, and a copy of it for bricks
     cv::Mat image_at(unsigned short image_index);
 
     // stack data manipulation
@@ -40,14 +85,29 @@ public:
     void normalize_pseudo_hounsfield();
     void threshold_data(unsigned short threshold);
 
-    void open_stack(unsigned short brush_size);
-    void close_stack(unsigned short brush_size);
-    void dilate_stack(unsigned short brush_size);
-    void erode_stack(unsigned short brush_size);
+    // the distance engines only work on binary masks, like the ones threshold_data makes
+    void open_stack(unsigned short brush_size, morphology_engine engine = morphology_engine::opencv);
+    void close_stack(unsigned short brush_size, morphology_engine engine = morphology_engine::opencv);
+    void dilate_stack(unsigned short brush_size, morphology_engine engine = morphology_engine::opencv);
+    void erode_stack(unsigned short brush_size, morphology_engine engine = morphology_engine::opencv);
 
     void mask_roi(Point3D from, Point3D to);
     void mask_roi(Point2D from, Point2D to);
 
+    // the smallest box (corners included) holding every non-zero voxel,
+    // returns false if there are none
+    bool non_zero_bounds(Point3D &from, Point3D &to);
+
+    // all of the above for cleaning with a mask, fused into a single pass
+    void apply_mask_pipeline(const mask_parameters &params);
+
+    // statistics, worked out when first asked for, and kept up to date where that's cheap
+    unsigned short get_min();
+    unsigned short get_max();
+    size_t count_non_zero();
+    const histogram &get_histogram();
+    const histogram &get_slice_histogram(unsigned short image_index);
+
     // meta data
     unsigned short get_image_count() const;
     unsigned short get_rows() const;
@@ -62,20 +122,61 @@ protected:
     const unsigned short image_count;
     const size_t fields;
 
-    void init_stack(unsigned short *ptr, bool copy);
+    void init_stack(unsigned short *ptr, bool copy, bool owning);
 
     void copy_data(const unsigned short *ptr);
     unsigned short *data_ptr;
+    // without copying, the stack may borrow someone else's data, and in memory, stacks share it
+    shared_ptr<volume_storage> storage;
+    // before writing, a stack that shares its data gets a copy of its own, or just a buffer, if it overwrites everything
+    void make_writable(bool keep_data = true);
+    void copy_statistics(const image_stack &other);
 
     void establish_min_max();
+    void ensure_min_max();
     unsigned short min;
     unsigned short max;
+    // only scanned for when someone needs them, and nothing knows them already
+    bool min_max_valid;
+
+    // the slices share the same bins, so they add up to the volume
+    void establish_histograms();
+    vector<histogram> slice_histograms;
+    histogram volume_histogram;
+    bool histograms_valid;
+
+    void invalidate_statistics();
 
     void init_images();
     std::vector<cv::Mat> images;
 
     inline unsigned short * ptr_to(unsigned short x, unsigned short y, unsigned short z);
-    void morph_stack(unsigned short operation, unsigned short brush_size);
+    void morph_stack(unsigned short operation, unsigned short brush_size, morphology_engine engine);
+    // element is only used by opencv, grid only by distance_disk, and needs room for one slice
+    void morph_slice(unsigned short *slice_ptr, unsigned short operation, const cv::Mat &element,
+                     unsigned short brush_size, morphology_engine engine, float *grid) const;
+    void mask_slice_roi(unsigned short *slice_ptr, unsigned short z, Point3D from, Point3D to) const;
+
+    // out of core stacks keep their data in bricks of brick_depth slices,
+    // in memory stacks behave like one brick holding all slices
+    shared_ptr<brick_cache> bricks;
+    vector<size_t> brick_ids;
+    unsigned short brick_depth;
+
+    void init_bricks();
+    unsigned short *acquire_slices(unsigned short first, bool writes) const;
+    void release_slices(unsigned short first) const;
+
+    // ptr points to count consecutive slices, starting at slice first
+    using slab_function = function<void(unsigned short *ptr, unsigned short first, unsigned short count)>;
+    using binary_slab_function = function<void(unsigned short *ptr, unsigned short *other_ptr,
+                                               unsigned short first, unsigned short count)>;
+
+    void for_each_slab(const slab_function &fn, bool writes = true);
+    void for_each_slab(const image_stack &other, const binary_slab_function &fn, bool writes = true);
+
+    // reads the stack a slab at a time for thresholding
+    friend class bit_mask;
 };
 
 
@@ -1,40 +1,242 @@
+#include <memory>
+#include <iostream>
+
+#include <opencv2/core.hpp>
+
 #include "options.hpp"
 #include "dicom.hpp"
+#include "brick_cache.hpp"
 #include "image_stack.hpp"
+#include "bit_mask.hpp"
+#include "progressive_loader.hpp"
 #include "scene.hpp"
+#include "volume_writer.hpp"
+#include "surface_writer.hpp"
+#include "profiler.hpp"
+#include "volume_pool.hpp"
+
+
+static void print_stages(size_t voxels) {
+    // without a window, timings are the only thing to look at,
+    // stages of other threads overlap the ones of the main thread, so they'd be counted twice
+    for (const stage_record &stage : profiler::instance().get_records())
+        if (stage.depth == 0 && !stage.background)
+            cout << stage.name << ": " << stage.wall_seconds << " s (" << stage.cpu_seconds << " s cpu)" << endl;
+
+    double seconds = profiler::instance().seconds_since_start();
+    cout << "Total: " << seconds << " s, " << (double) voxels / seconds / 1e6 << " MVoxel/s" << endl;
+}
+
+static void write_profile(const options &opts) {
+    if (!opts.profile_path.empty() && !profiler::instance().write_json(opts.profile_path))
+        cerr << "Warning: Can't write the profile to " << opts.profile_path << endl;
+}
+
+static mask_parameters cleaning_parameters(const options &opts) {
+    return mask_parameters{opts.threshold,
+                           opts.has_roi,
+                           opts.roi_from,
+                           opts.roi_to,
+                           opts.brush_size,
+                           (unsigned short) (opts.brush_size * 2),
+                           (unsigned short) (opts.brush_size * 2),
+                           opts.engine};
+}
+
+static int render_progressive(const options &opts) {
+    // only the headers are read up front, since ordering the slices and sizing the volume takes all of them,
+    // then the window opens on an empty volume, which fills up while we look at it
+    dicom dcm(opts.input_path, opts.threads, false, true, opts.use_index);
+    progressive_loader loader(dcm, cleaning_parameters(opts), opts.threads);
+
+    // the loader keeps writing through the pointer, which the scene owns from now on
+    scene s(dcm.release_data_ptr(),
+            dcm.get_x(),
+            dcm.get_y(),
+            dcm.get_z(),
+            dcm.get_meta_data(),
+            true);
+
+    s.set_frame_time_target(opts.frame_time / 1000);
+    if (opts.renderer != render_engine::gpu)
+        s.use_renderer(opts.renderer, opts.threads);
+
+    s.set_frame_hook([&loader](scene &target) {
+        if (loader.has_changes())
+            target.update_data([&loader]() {
+                loader.commit();
+                return loader.is_complete();
+            });
+
+        target.set_status(loader.is_complete() ? "" : "Loading: " + to_string(loader.get_committed()) + "/"
+                                                      + to_string(loader.get_total()) + " slices");
+    });
+
+    write_profile(opts);
+
+    return s.render();
+}
 
 
 int main(int argc, char **argv) {
     options opts(argc, argv);
-    dicom dcm(opts.input_path);
+    // loading and processing share the same number of threads
+    cv::setNumThreads(opts.threads);
+
+    if (opts.headless || !opts.profile_path.empty())
+        profiler::instance().enable();
+
+    volume_pool::instance().set_huge_pages(opts.huge_pages);
+    volume_pool::instance().set_first_touch(opts.first_touch);
+
+    if (opts.progressive)
+        return render_progressive(opts);
+
+    scoped_timer loading("load", 0, opts.threads);
 
-    image_stack unchanged(dcm.get_data_ptr(),
-                          dcm.get_x(),
-                          dcm.get_y(),
-                          dcm.get_z(),
-                          false);
+    dicom dcm(opts.input_path, opts.threads, opts.use_cache, false, opts.use_index);
 
-    image_stack mask(unchanged);
+    image_stack unchanged(dcm);
 
-    mask.threshold_data(opts.threshold);
+    size_t voxels = (size_t) unchanged.get_x() * unchanged.get_y() * unchanged.get_z();
+    loading.set_bytes(sizeof(unsigned short) * voxels);
+    loading.stop();
 
-    if (opts.has_roi)
-        mask.mask_roi(opts.roi_from, opts.roi_to);
+    // the histogram of the loaded data knows better than a fixed default
+    if (opts.auto_threshold) {
+        opts.threshold = unchanged.get_histogram().otsu_threshold();
+        cout << "Otsu threshold: " << opts.threshold << endl;
+    }
 
-    mask.open_stack(opts.brush_size);
-    mask.close_stack(opts.brush_size * 2);
-    mask.dilate_stack(opts.brush_size * 2);
+    // with a memory budget, the working copies are paged through bricks
+    shared_ptr<brick_cache> bricks;
+    if (opts.max_memory)
+        bricks = make_shared<brick_cache>(opts.max_memory);
 
-    image_stack masked(unchanged);
+    scoped_timer cleaning("clean", sizeof(unsigned short) * voxels, opts.threads);
+
+    // in memory, the loaded data is only needed until masked writes to it, so masked just takes it over,
+    // and the mask shares it until it's thresholded, that leaves two volumes at most
+    image_stack masked = bricks ? image_stack(unchanged, bricks) : std::move(unchanged);
+
+    if (opts.fused) {
+        masked.apply_mask_pipeline(cleaning_parameters(opts));
+    } else if (opts.use_bit_mask) {
+        bit_mask mask(masked, opts.threshold);
+
+        if (opts.has_roi)
+            mask.mask_roi(opts.roi_from, opts.roi_to);
+
+        mask.open_mask(opts.brush_size);
+        mask.close_mask(opts.brush_size * 2);
+        mask.dilate_mask(opts.brush_size * 2);
+
+        masked & mask;
+    } else {
+        image_stack mask(masked, bricks);
+
+        mask.threshold_data(opts.threshold);
+
+        if (opts.has_roi)
+            mask.mask_roi(opts.roi_from, opts.roi_to);
+
+        mask.open_stack(opts.brush_size, opts.engine);
+        mask.close_stack(opts.brush_size * 2, opts.engine);
+        mask.dilate_stack(opts.brush_size * 2, opts.engine);
+
+        masked & mask;
+    }
+
+    cleaning.stop();
+
+    scoped_timer normalizing("normalize", sizeof(unsigned short) * voxels);
 
-    masked & mask;
     masked.normalize_pseudo_hounsfield();
 
-    scene s(masked.get_data_ptr(),
-            masked.get_x(),
-            masked.get_y(),
-            masked.get_z(),
-            dcm.get_meta_data());
+    // the renderer needs everything in memory, so a bricked result goes
+    // back into the loaded volume, which we don't need anymore
+    image_stack *result = &masked;
+    if (masked.is_bricked()) {
+        unchanged.copy_from(masked);
+        result = &unchanged;
+    }
+
+    normalizing.stop();
+
+    if (!opts.output_path.empty()) {
+        scoped_timer writing("write", sizeof(unsigned short) * voxels);
+        if (!write_volume(opts.output_path, result->get_data_ptr(), result->get_x(), result->get_y(), result->get_z())) {
+            cerr << "Couldn't write the volume to " << opts.output_path << endl;
+            exit(23);
+        }
+    }
+
+    if (!opts.surface_path.empty()) {
+        scoped_timer surfacing("surface", sizeof(unsigned short) * voxels, opts.threads);
+        if (!write_surface(opts.surface_path, result->get_data_ptr(), result->get_x(), result->get_y(), result->get_z(),
+                           opts.iso, opts.decimate, opts.threads)) {
+            cerr << "Couldn't write the surface to " << opts.surface_path << endl;
+            exit(34);
+        }
+    }
+
+    if (opts.headless) {
+        print_stages(voxels);
+        write_profile(opts);
+        return EXIT_SUCCESS;
+    }
+
+    // empty space costs texture memory and ray steps, so the scene only gets the box around what's left,
+    // placed where it was in the whole volume
+    Point3D origin{0, 0, 0};
+    Point3D crop_to{};
+    unique_ptr<image_stack> cropped;
+    if (opts.crop && result->non_zero_bounds(origin, crop_to)) {
+        size_t crop_voxels = (size_t) (crop_to.x - origin.x + 1) * (crop_to.y - origin.y + 1) * (crop_to.z - origin.z + 1);
+        if (crop_voxels < voxels) {
+            scoped_timer cropping("crop", sizeof(unsigned short) * voxels);
+            cropped = make_unique<image_stack>(*result, origin, crop_to);
+            result = cropped.get();
+        } else {
+            origin = Point3D{0, 0, 0};
+        }
+    }
+
+    // transparent up to the median of what's left, opaque from the brightest percent on,
+    // worked out while the data is still ours
+    unsigned short window_lower = 0;
+    unsigned short window_upper = 0;
+    if (opts.auto_window) {
+        const histogram &result_histogram = result->get_histogram();
+        window_lower = result_histogram.percentile(.5, true);
+        window_upper = result_histogram.percentile(.99, true);
+    }
+
+    // if possible, the scene takes over the buffer, instead of copying it
+    bool handoff = result->is_owning();
+    unsigned short *data_ptr = handoff ? result->release_data_ptr() : result->get_data_ptr();
+
+    scoped_timer setting_up("scene", sizeof(unsigned short) * result->get_x() * result->get_y() * result->get_z());
+
+    scene s(data_ptr,
+            result->get_x(),
+            result->get_y(),
+            result->get_z(),
+            dcm.get_meta_data(),
+            handoff,
+            origin);
+
+    if (opts.auto_window && window_upper > window_lower)
+        s.set_initial_transparency_window((window_lower + window_upper) / 2, window_upper - window_lower);
+
+    s.set_frame_time_target(opts.frame_time / 1000);
+    s.set_quantized_upload(opts.quantize);
+    if (opts.renderer != render_engine::gpu)
+        s.use_renderer(opts.renderer, opts.threads);
+
+    // rendering only ends when the program does, so the profile covers everything up to here
+    setting_up.stop();
+    write_profile(opts);
 
     return s.render();
 }
@@ -3,11 +3,15 @@
 //
 
 #include <iostream>
+#include <thread>
 #include <filesystem>
 
 #include <boost/program_options.hpp>
 
 #include "options.hpp"
+#include "simd_kernels.hpp"
+#include "volume_writer.hpp"
+#include "surface_writer.hpp"
 
 
 namespace fs = filesystem;
@@ -65,7 +69,31 @@ void options::declare_args() {
         ("threshold,t", po::value<unsigned short>(), "threshold for binarization of cleaning mask (default is 250)")
         ("brush,b", po::value<unsigned short>(), "size of brush for cleaning with morphological operations (default is 25)")
         ("lower,l", po::value<string>(), "comma separated pair of integer numbers \"<row,col>\", for defining region of interest")
-        ("upper,u", po::value<string>(), "comma separated pair of integer numbers \"<row,col>\", for defining region of interest");
+        ("upper,u", po::value<string>(), "comma separated pair of integer numbers \"<row,col>\", for defining region of interest")
+        ("threads,j", po::value<unsigned short>(), "number of threads for loading and processing slices, and rendering on the CPU (default is the number of cores)")
+        ("cache,c", "cache the loaded volume in the input folder, for faster re-opening")
+        ("no-index", "don't keep an index of the headers in the input folder, read all of them every time")
+        ("max-memory,m", po::value<size_t>(), "memory budget in MiB for processing out of core in bricks (default is in memory)")
+        ("huge-pages", "back volumes with transparent huge pages, if the kernel has them")
+        ("first-touch", "fault in new volumes on all threads at once, instead of on whichever thread writes first")
+        ("fused,f", "clean the data in a single pass, a slice at a time, instead of step by step")
+        ("simd", po::value<string>(), "instruction set for processing voxels, one of auto, scalar, sse4.2, avx2 or avx512 (default is auto)")
+        ("morphology", po::value<string>(), "implementation of the morphological operations, either opencv or distance (default is opencv)")
+        ("sphere", "clean with a 3D ball instead of a disk per layer, implies --morphology distance")
+        ("bitmask", "keep the cleaning mask at one bit per voxel, instead of a copy of the volume")
+        ("auto-threshold", "pick the threshold for the cleaning mask from the histogram (Otsu)")
+        ("auto-window", "start with a transparency window fitted to the histogram of the result")
+        ("output,o", po::value<string>(), "write the cleaned volume to a .raw file, or a .mhd file with a .raw file next to it")
+        ("surface", po::value<string>(), "write the surface of the cleaned volume to a binary .stl or .ply file")
+        ("iso", po::value<short>(), "value in HU the surface is extracted at (default is 350, cancellous bone)")
+        ("decimate", po::value<double>(), "merge the vertices of the surface within bins of this many voxels (default is to keep all)")
+        ("headless", "don't render, just process (and write) the volume, and print how long that took")
+        ("profile", po::value<string>(), "write how long every stage took to a JSON file")
+        ("no-crop", "render the whole volume, instead of just the box around what's left after cleaning")
+        ("renderer", po::value<string>(), "where to ray cast, either gpu or cpu (default is gpu)")
+        ("quantize", "upload 8 bits per voxel to the GPU instead of 16, quantized around the transparency window")
+        ("progressive", "open the window once the headers are read, and load and clean the slices while it's open, every 8th one first")
+        ("frame-time", po::value<double>(), "time in ms a frame may take while interacting, quality is lowered to keep up (default is 33)");
 
     po::options_description opts_desc_hidden("Hidden options");
     opts_desc_hidden.add_options()("input", po::value<vector<string>>(), "input folder");
@@ -145,9 +173,158 @@ void options::validate_args() {
     if (parsed_args->count("threshold"))
         threshold = (*parsed_args)["threshold"].as<unsigned short>();
 
+    // the threshold itself is only known once the data is loaded
+    auto_threshold = parsed_args->count("auto-threshold");
+    if (auto_threshold && parsed_args->count("threshold"))
+        std::cerr << "Warning, both --threshold and --auto-threshold were passed, ignoring --threshold\n" << std::endl;
+
+    auto_window = parsed_args->count("auto-window");
+
     brush_size = 25;
     if (parsed_args->count("brush"))
         brush_size = (*parsed_args)["brush"].as<unsigned short>();
+
+    // hardware_concurrency may return 0 if it can't tell
+    threads = max(thread::hardware_concurrency(), 1u);
+    if (parsed_args->count("threads"))
+        threads = (*parsed_args)["threads"].as<unsigned short>();
+
+    use_cache = parsed_args->count("cache");
+    use_index = !parsed_args->count("no-index");
+    fused = parsed_args->count("fused");
+    use_bit_mask = parsed_args->count("bitmask");
+
+    huge_pages = parsed_args->count("huge-pages");
+    first_touch = parsed_args->count("first-touch");
+
+    // 0 means no budget, so everything stays in memory
+    max_memory = 0;
+    if (parsed_args->count("max-memory"))
+        max_memory = (*parsed_args)["max-memory"].as<size_t>() << 20;
+
+    engine = morphology_engine::opencv;
+    if (parsed_args->count("morphology")) {
+        string morphology = (*parsed_args)["morphology"].as<string>();
+        if (morphology == "distance") {
+            engine = morphology_engine::distance_disk;
+        } else if (morphology != "opencv") {
+            std::cerr << "Unknown morphology implementation: " << morphology << "\n" << std::endl;
+            print_usage();
+            exit(19);
+        }
+    }
+
+    if (parsed_args->count("sphere")) {
+        // the ball needs all layers at once
+        if (fused || max_memory) {
+            std::cerr << "A spherical brush can't be combined with --fused or --max-memory!\n" << std::endl;
+            print_usage();
+            exit(20);
+        }
+        engine = morphology_engine::distance_sphere;
+    }
+
+    if (use_bit_mask && (fused || engine != morphology_engine::opencv)) {
+        // the bit mask brings its own morphology, and the fused pipeline its own mask
+        std::cerr << "--bitmask can't be combined with --fused, --morphology distance or --sphere!\n" << std::endl;
+        print_usage();
+        exit(21);
+    }
+
+    if (parsed_args->count("simd")) {
+        string simd = (*parsed_args)["simd"].as<string>();
+        if (!use_kernels(simd)) {
+            std::cerr << "The instruction set " << simd << " is unknown, or not supported by this CPU!\n" << std::endl;
+            print_usage();
+            exit(16);
+        }
+    }
+
+    headless = parsed_args->count("headless");
+
+    if (parsed_args->count("profile"))
+        profile_path = (*parsed_args)["profile"].as<string>();
+
+    if (parsed_args->count("output")) {
+        output_path = (*parsed_args)["output"].as<string>();
+        if (!is_volume_path(output_path)) {
+            std::cerr << "The output " << output_path << " has to end in .raw or .mhd!\n" << std::endl;
+            print_usage();
+            exit(22);
+        }
+    }
+
+    if (parsed_args->count("surface")) {
+        surface_path = (*parsed_args)["surface"].as<string>();
+        if (!is_surface_path(surface_path)) {
+            std::cerr << "The surface " << surface_path << " has to end in .stl or .ply!\n" << std::endl;
+            print_usage();
+            exit(31);
+        }
+    }
+
+    // the volume is in pseudo hounsfield units by the time the surface is extracted, 16 steps per HU from -1024 on
+    short iso_hu = 350;
+    if (parsed_args->count("iso"))
+        iso_hu = (*parsed_args)["iso"].as<short>();
+    if (iso_hu < -1024 || iso_hu > 3071) {
+        std::cerr << "The iso value has to be between -1024 and 3071 HU!\n" << std::endl;
+        print_usage();
+        exit(32);
+    }
+    iso = (unsigned short) ((iso_hu + 1024) * 16);
+
+    decimate = 0;
+    if (parsed_args->count("decimate")) {
+        decimate = (*parsed_args)["decimate"].as<double>();
+        if (!(decimate > 0)) {
+            std::cerr << "The bins for decimating have to be more than 0 voxels!\n" << std::endl;
+            print_usage();
+            exit(33);
+        }
+    }
+
+    crop = !parsed_args->count("no-crop");
+    quantize = parsed_args->count("quantize");
+
+    renderer = render_engine::gpu;
+    if (parsed_args->count("renderer")) {
+        string name = (*parsed_args)["renderer"].as<string>();
+        if (name == "cpu") {
+            renderer = render_engine::cpu;
+        } else if (name != "gpu") {
+            std::cerr << "Unknown renderer: " << name << "\n" << std::endl;
+            print_usage();
+            exit(26);
+        }
+    }
+
+    frame_time = 33;
+    if (parsed_args->count("frame-time")) {
+        frame_time = (*parsed_args)["frame-time"].as<double>();
+        if (!(frame_time > 0)) {
+            std::cerr << "The frame time has to be more than 0 ms!\n" << std::endl;
+            print_usage();
+            exit(24);
+        }
+    }
+
+    progressive = parsed_args->count("progressive");
+    if (progressive && (use_cache || max_memory || use_bit_mask || engine == morphology_engine::distance_sphere
+                        || auto_threshold || auto_window || quantize || headless || !output_path.empty()
+                        || !surface_path.empty())) {
+        // slices are cleaned as they come in, with the fused pipeline, and only ever end up on screen
+        std::cerr << "--progressive can't be combined with --cache, --max-memory, --bitmask, --sphere, --auto-threshold, "
+                     "--auto-window, --quantize, --headless, --output or --surface!\n" << std::endl;
+        print_usage();
+        exit(29);
+    }
+
+    if (threads == 0) {
+        std::cerr << "Need at least one thread!\n" << std::endl;
+        print_usage();
+        exit(9);
+    }
 }
 
 void options::clean_up() {
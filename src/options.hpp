@@ -7,6 +7,7 @@
 
 #include <boost/program_options.hpp>
 #include "convenience.hpp"
+#include "distance_morphology.hpp"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -37,6 +38,28 @@ public:
     Point2D roi_from;
     Point2D roi_to;
     unsigned short brush_size;
+    unsigned short threads;
+    bool use_cache;
+    bool use_index;
+    size_t max_memory;
+    bool huge_pages;
+    bool first_touch;
+    bool fused;
+    bool use_bit_mask;
+    bool auto_threshold;
+    bool auto_window;
+    bool headless;
+    string output_path;
+    string surface_path;
+    unsigned short iso;
+    double decimate;
+    string profile_path;
+    double frame_time;
+    bool crop;
+    bool quantize;
+    bool progressive;
+    render_engine renderer;
+    morphology_engine engine;
 
     options(int argc, char **argv);
 };
@@ -0,0 +1,139 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <ctime>
+#include <fstream>
+#include <algorithm>
+
+#include <nlohmann/json.hpp>
+
+#include "profiler.hpp"
+
+
+using namespace std;
+using json = nlohmann::json;
+
+
+// how deep the timers running on this thread are nested
+static thread_local unsigned int timer_depth = 0;
+
+
+profiler::profiler() :
+    enabled(false),
+    started(chrono::steady_clock::now()) {}
+
+profiler &profiler::instance() {
+    static profiler global;
+    return global;
+}
+
+void profiler::enable() {
+    main_thread = this_thread::get_id();
+    enabled = true;
+}
+
+bool profiler::is_enabled() const {
+    return enabled;
+}
+
+bool profiler::is_main_thread() const {
+    return this_thread::get_id() == main_thread;
+}
+
+void profiler::record(const stage_record &stage) {
+    lock_guard<mutex> guard(records_lock);
+    records.push_back(stage);
+}
+
+vector<stage_record> profiler::get_records() const {
+    vector<stage_record> sorted;
+    {
+        lock_guard<mutex> guard(records_lock);
+        sorted = records;
+    }
+
+    // stages are recorded when they end, so the outer ones come last
+    stable_sort(sorted.begin(), sorted.end(), [](const stage_record &a, const stage_record &b) {
+        return a.start_seconds < b.start_seconds;
+    });
+    return sorted;
+}
+
+bool profiler::write_json(const string &path) const {
+    json stages = json::array();
+    for (const stage_record &stage : get_records()) {
+        stages.push_back({
+            {"name", stage.name},
+            {"depth", stage.depth},
+            {"background", stage.background},
+            {"start_seconds", stage.start_seconds},
+            {"wall_seconds", stage.wall_seconds},
+            {"cpu_seconds", stage.cpu_seconds},
+            {"bytes", stage.bytes},
+            {"threads", stage.threads},
+        });
+    }
+
+    json report = {
+        {"wall_seconds", seconds_since_start()},
+        {"cpu_seconds", cpu_seconds()},
+        {"stages", stages},
+    };
+
+    ofstream file(path, ios::trunc);
+    if (!file)
+        return false;
+
+    file << report.dump(4) << endl;
+    file.close();
+    return (bool) file;
+}
+
+double profiler::seconds_since_start() const {
+    return chrono::duration<double>(chrono::steady_clock::now() - started).count();
+}
+
+double profiler::cpu_seconds() {
+    // every thread of the process, not just the one asking
+    timespec time{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+
+scoped_timer::scoped_timer(string name, size_t bytes, unsigned int threads) :
+    running(profiler::instance().is_enabled()),
+    stage() {
+    // a disabled profiler costs one check
+    if (!running)
+        return;
+
+    stage.name = std::move(name);
+    stage.depth = timer_depth++;
+    stage.background = !profiler::instance().is_main_thread();
+    stage.bytes = bytes;
+    stage.threads = threads;
+    stage.start_seconds = profiler::instance().seconds_since_start();
+    stage.cpu_seconds = profiler::cpu_seconds();
+}
+
+scoped_timer::~scoped_timer() {
+    stop();
+}
+
+void scoped_timer::set_bytes(size_t bytes) {
+    stage.bytes = bytes;
+}
+
+void scoped_timer::stop() {
+    if (!running)
+        return;
+
+    running = false;
+    timer_depth--;
+
+    stage.wall_seconds = profiler::instance().seconds_since_start() - stage.start_seconds;
+    stage.cpu_seconds = profiler::cpu_seconds() - stage.cpu_seconds;
+    profiler::instance().record(stage);
+}
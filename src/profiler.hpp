@@ -0,0 +1,83 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_PROFILER_HPP
+#define ABGABE_CG_VIS_PROFILER_HPP
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstddef>
+
+using namespace std;
+
+
+// what one stage of the pipeline took, cpu time is summed over all threads of the process,
+// so cpu_seconds / wall_seconds tells how well the threads were used
+struct stage_record {
+    string name;
+    // nesting depth, stages inside of stages are one deeper, counted per thread
+    unsigned int depth;
+    // timed on some other thread than the one that enabled the profiler, like the pyramid builder
+    bool background;
+    double start_seconds;
+    double wall_seconds;
+    double cpu_seconds;
+    size_t bytes;
+    unsigned int threads;
+};
+
+
+// collects stage records for the whole process, does nothing until enabled
+class profiler {
+public:
+    static profiler &instance();
+
+    // the calling thread is the main one from then on
+    void enable();
+    bool is_enabled() const;
+    bool is_main_thread() const;
+
+    void record(const stage_record &stage);
+    // in the order they started
+    vector<stage_record> get_records() const;
+    bool write_json(const string &path) const;
+
+    double seconds_since_start() const;
+    static double cpu_seconds();
+protected:
+    profiler();
+
+    // worker threads ask too
+    atomic<bool> enabled;
+    thread::id main_thread;
+    chrono::steady_clock::time_point started;
+
+    mutable mutex records_lock;
+    vector<stage_record> records;
+};
+
+
+// times a stage from construction to stop() or destruction, whichever comes first
+class scoped_timer {
+public:
+    explicit scoped_timer(string name, size_t bytes = 0, unsigned int threads = 1);
+    ~scoped_timer();
+
+    scoped_timer(const scoped_timer &) = delete;
+    scoped_timer &operator=(const scoped_timer &) = delete;
+
+    // for stages that only know how much they did at the end
+    void set_bytes(size_t bytes);
+    void stop();
+protected:
+    bool running;
+    stage_record stage;
+};
+
+
+#endif //ABGABE_CG_VIS_PROFILER_HPP
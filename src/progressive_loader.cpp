@@ -0,0 +1,135 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <algorithm>
+
+#include "progressive_loader.hpp"
+#include "profiler.hpp"
+
+
+using namespace std;
+
+
+progressive_loader::progressive_loader(dicom &dcm, const mask_parameters &params, unsigned short threads) :
+    dcm(dcm),
+    params(params),
+    threads(threads),
+    slice_fields((size_t) dcm.get_x() * dcm.get_y()),
+    total(dcm.get_z()),
+    committed(0),
+    last_commit(chrono::steady_clock::now()),
+    done(false),
+    cancelled(false) {
+    worker = thread(&progressive_loader::run, this);
+}
+
+progressive_loader::~progressive_loader() {
+    cancelled = true;
+    if (worker.joinable())
+        worker.join();
+}
+
+void progressive_loader::run() {
+    scoped_timer timer("progressive_loader::run", sizeof(unsigned short) * slice_fields * total, threads);
+
+    // every stride-th slice first, then the ones in between
+    vector<size_t> order;
+    for (size_t i = 0; i < total; i += PROGRESSIVE_STRIDE)
+        order.push_back(i);
+    size_t first_pass = order.size();
+    for (size_t i = 0; i < total; i++)
+        if (i % PROGRESSIVE_STRIDE)
+            order.push_back(i);
+
+    // small enough to show up quickly, big enough to keep all threads loading
+    size_t batch_size = std::max<size_t>(2 * threads, 4);
+
+    size_t start = 0;
+    while (start < total && !cancelled) {
+        // batches don't reach over into the second pass, so they know whether to stand in for others
+        size_t end = std::min(start + batch_size, start < first_pass ? first_pass : total);
+
+        batch next{vector<size_t>(order.begin() + start, order.begin() + end),
+                   vector<unsigned short>((end - start) * slice_fields),
+                   start < first_pass};
+        load_error error = dcm.load_slices(next.indices, threads, next.data.data());
+        if (error.code) {
+            lock_guard<mutex> guard(lock);
+            failure = error;
+            return;
+        }
+
+        // the fused pipeline works slice by slice anyway, so it doesn't care that they aren't neighbours
+        image_stack slices(next.data.data(), dcm.get_x(), dcm.get_y(), (unsigned short) (end - start), false, false);
+        slices.apply_mask_pipeline(params);
+        slices.normalize_pseudo_hounsfield();
+
+        {
+            lock_guard<mutex> guard(lock);
+            finished.push_back(std::move(next));
+        }
+
+        start = end;
+    }
+
+    done = true;
+}
+
+bool progressive_loader::has_changes() {
+    unique_lock<mutex> guard(lock);
+    if (failure.code) {
+        // exiting while the worker is still in DCMTK would pull it out from under it
+        guard.unlock();
+        worker.join();
+        cerr << failure.message << endl;
+        exit(failure.code);
+    }
+
+    if (finished.empty())
+        return false;
+
+    // the last batch shouldn't wait
+    chrono::duration<double> since = chrono::steady_clock::now() - last_commit;
+    return done || since.count() >= COMMIT_SECONDS;
+}
+
+bool progressive_loader::commit() {
+    deque<batch> ready;
+    {
+        lock_guard<mutex> guard(lock);
+        ready.swap(finished);
+    }
+
+    if (ready.empty())
+        return false;
+
+    unsigned short *volume = dcm.get_data_ptr();
+    for (const batch &b : ready) {
+        for (size_t k = 0; k < b.indices.size(); k++) {
+            const unsigned short *slice_ptr = b.data.data() + k * slice_fields;
+            size_t index = b.indices[k];
+            size_t last = b.first_pass ? std::min(index + PROGRESSIVE_STRIDE, total) : index + 1;
+
+            for (size_t target = index; target < last; target++)
+                copy(slice_ptr, slice_ptr + slice_fields, volume + target * slice_fields);
+        }
+
+        committed += b.indices.size();
+    }
+
+    last_commit = chrono::steady_clock::now();
+    return true;
+}
+
+bool progressive_loader::is_complete() const {
+    return committed == total;
+}
+
+size_t progressive_loader::get_committed() const {
+    return committed;
+}
+
+size_t progressive_loader::get_total() const {
+    return total;
+}
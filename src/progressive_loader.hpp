@@ -0,0 +1,79 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_PROGRESSIVE_LOADER_HPP
+#define ABGABE_CG_VIS_PROGRESSIVE_LOADER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+#include "dicom.hpp"
+#include "image_stack.hpp"
+
+using namespace std;
+
+
+// the first pass loads every so many slices, which stand in for the ones between them until those are loaded
+static const unsigned short PROGRESSIVE_STRIDE = 8;
+// every commit uploads the whole volume again, so they shouldn't come too often
+static const double COMMIT_SECONDS = .25;
+
+
+// loads and cleans the slices of a deferred dicom on a background thread, batch by batch,
+// and only ever writes to the volume in commit, on the thread that renders it
+class progressive_loader {
+public:
+    // dcm has to be deferred, and outlive the loader
+    progressive_loader(dicom &dcm, const mask_parameters &params, unsigned short threads);
+    // stops after the batch it's working on
+    ~progressive_loader();
+
+    progressive_loader(const progressive_loader &) = delete;
+    progressive_loader &operator=(const progressive_loader &) = delete;
+
+    // whether there are batches to commit, and it's been long enough since the last commit,
+    // exits if loading failed, once the worker is gone
+    bool has_changes();
+    // copies the finished batches into the volume, and says whether there were any
+    bool commit();
+    // every slice has been committed
+    bool is_complete() const;
+
+    size_t get_committed() const;
+    size_t get_total() const;
+protected:
+    struct batch {
+        vector<size_t> indices;
+        vector<unsigned short> data;
+        // slices of the first pass stand in for the ones after them
+        bool first_pass;
+    };
+
+    dicom &dcm;
+    const mask_parameters params;
+    const unsigned short threads;
+    const size_t slice_fields;
+    const size_t total;
+
+    mutex lock;
+    deque<batch> finished;
+    // the worker stops at the first batch that fails
+    load_error failure;
+    size_t committed;
+    chrono::steady_clock::time_point last_commit;
+
+    atomic<bool> done;
+    atomic<bool> cancelled;
+    thread worker;
+
+    void run();
+};
+
+
+#endif //ABGABE_CG_VIS_PROGRESSIVE_LOADER_HPP
@@ -0,0 +1,116 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <algorithm>
+
+#include <opencv2/core.hpp>
+
+#include "quantized_volume.hpp"
+#include "simd_kernels.hpp"
+#include "profiler.hpp"
+
+
+using namespace std;
+
+
+// chunks are big enough to not drown in scheduling, and small enough to spread over all threads
+static const size_t QUANTIZE_CHUNK = 1 << 20;
+
+
+static void quantize_parallel(const unsigned short *ptr, size_t count, unsigned short low, unsigned short high,
+                              unsigned char *out) {
+    scoped_timer timer("quantized_volume::quantize", sizeof(unsigned short) * count, cv::getNumThreads());
+    const simd_kernels &kernels = active_kernels();
+    int chunks = (int) ((count + QUANTIZE_CHUNK - 1) / QUANTIZE_CHUNK);
+
+    cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &range) {
+        for (int chunk = range.start; chunk < range.end; chunk++) {
+            size_t first = chunk * QUANTIZE_CHUNK;
+            kernels.quantize(ptr + first, std::min(QUANTIZE_CHUNK, count - first), low, high, out + first);
+        }
+    });
+}
+
+
+quantized_volume::quantized_volume(const unsigned short *data_ptr, size_t count) :
+    data_ptr(data_ptr),
+    count(count),
+    data(count),
+    low(0),
+    high(0),
+    next_low(0),
+    next_high(0),
+    next_ready(false),
+    running(false) {}
+
+quantized_volume::~quantized_volume() {
+    wait();
+}
+
+void quantized_volume::wait() {
+    if (worker.joinable())
+        worker.join();
+}
+
+void quantized_volume::quantize(unsigned short low, unsigned short high) {
+    quantize_parallel(data_ptr, count, low, high, data.data());
+    this->low = low;
+    this->high = high;
+}
+
+void quantized_volume::requantize(unsigned short low, unsigned short high) {
+    if (running)
+        return;
+
+    // the last run was collected, so nobody uses its buffer anymore
+    wait();
+    next_data.resize(count);
+    next_low = low;
+    next_high = high;
+    next_ready = false;
+    running = true;
+
+    worker = thread([this]() {
+        quantize_parallel(data_ptr, count, next_low, next_high, next_data.data());
+        next_ready.store(true, memory_order_release);
+    });
+}
+
+bool quantized_volume::collect() {
+    if (!running || !next_ready.load(memory_order_acquire))
+        return false;
+
+    wait();
+    running = false;
+
+    data.swap(next_data);
+    low = next_low;
+    high = next_high;
+    return true;
+}
+
+bool quantized_volume::covers(unsigned short low, unsigned short high) const {
+    return this->low <= low && high <= this->high;
+}
+
+double quantized_volume::to_quantized(double value) const {
+    double range = high > low ? high - low : 1;
+    return (value - low) * 255 / range;
+}
+
+unsigned char *quantized_volume::get_data_ptr() {
+    return data.data();
+}
+
+size_t quantized_volume::get_count() const {
+    return count;
+}
+
+unsigned short quantized_volume::get_low() const {
+    return low;
+}
+
+unsigned short quantized_volume::get_high() const {
+    return high;
+}
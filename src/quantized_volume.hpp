@@ -0,0 +1,65 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_QUANTIZED_VOLUME_HPP
+#define ABGABE_CG_VIS_QUANTIZED_VOLUME_HPP
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+
+// an 8 bit copy of a 16 bit volume, with low..high mapped onto 0..255,
+// which can be redone in the background, while the old one is still in use
+class quantized_volume {
+public:
+    // the data is not copied, so it has to outlive the quantized volume
+    quantized_volume(const unsigned short *data_ptr, size_t count);
+    // waits for a background run to finish
+    ~quantized_volume();
+
+    quantized_volume(const quantized_volume &) = delete;
+    quantized_volume &operator=(const quantized_volume &) = delete;
+
+    // right away, on the calling thread
+    void quantize(unsigned short low, unsigned short high);
+    // on a background thread, unless one is still running
+    void requantize(unsigned short low, unsigned short high);
+    // swaps in what the background thread made, if it's done, and says so,
+    // the old data stays valid until the next requantize
+    bool collect();
+    // for a background run to finish, without swapping it in
+    void wait();
+
+    // whether values between low and high keep their detail
+    bool covers(unsigned short low, unsigned short high) const;
+    // where a 16 bit value ends up, without the clamping, for transfer functions
+    double to_quantized(double value) const;
+
+    unsigned char *get_data_ptr();
+    size_t get_count() const;
+    unsigned short get_low() const;
+    unsigned short get_high() const;
+protected:
+    const unsigned short *data_ptr;
+    const size_t count;
+
+    vector<unsigned char> data;
+    unsigned short low;
+    unsigned short high;
+
+    // what the background thread works on
+    vector<unsigned char> next_data;
+    unsigned short next_low;
+    unsigned short next_high;
+    thread worker;
+    atomic<bool> next_ready;
+    bool running;
+};
+
+
+#endif //ABGABE_CG_VIS_QUANTIZED_VOLUME_HPP
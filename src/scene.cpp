@@ -3,6 +3,7 @@
 //
 
 #include <cmath>
+#include <algorithm>
 
 #include <vtkNew.h>
 #include <vtkNamedColors.h>
@@ -15,9 +16,12 @@
 
 #include <vtkPolyDataMapper.h>
 #include <vtkOpenGLGPUVolumeRayCastMapper.h>
+#include <vtkFixedPointVolumeRayCastMapper.h>
 
 #include <vtkImageData.h>
-#include <vtkMarchingCubes.h>
+#include <vtkPointData.h>
+#include <vtkUnsignedShortArray.h>
+#include <vtkUnsignedCharArray.h>
 #include <vtkVolume.h>
 #include <vtkVolumeProperty.h>
 #include <vtkColorTransferFunction.h>
@@ -30,6 +34,8 @@
 
 #include "scene.hpp"
 #include "convenience.hpp"
+#include "profiler.hpp"
+#include "volume_pool.hpp"
 
 
 unsigned short MAX_USHORT = -1;
@@ -40,6 +46,40 @@ unsigned short USHORT_CANCELLOUS_BONE = 21984;
 unsigned short USHORT_CORTICAL_BONE_LOWER = 24384;
 unsigned short USHORT_CORTICAL_BONE_UPPER = 46784;
 
+// how much coarser than full quality the samples may get, in both image and depth
+double MAX_QUALITY_SCALE = 4;
+// how long it has to be quiet before rendering at full quality
+double IDLE_SECONDS = .15;
+// quantizing covers the window and this much of its width on either side, so small moves don't need a new one
+double QUANTIZE_MARGIN = .25;
+
+
+static void set_quantized_scalars(vtkImageData *target, quantized_volume &from) {
+    // VTK only borrows the bytes, they stay valid until the next quantization gets collected
+    vtkNew<vtkUnsignedCharArray> bytes;
+    bytes->SetNumberOfComponents(1);
+    bytes->SetArray(from.get_data_ptr(), (vtkIdType) from.get_count(), 1);
+    target->GetPointData()->SetScalars(bytes);
+    target->Modified();
+}
+
+static void set_sample_distances(vtkVolumeMapper *mapper, double sample_distance, double image_sample_distance) {
+    // both mappers have them, but not from a common base
+    if (auto *gpu = vtkGPUVolumeRayCastMapper::SafeDownCast(mapper)) {
+        gpu->SetSampleDistance((float) sample_distance);
+        gpu->SetImageSampleDistance((float) image_sample_distance);
+    } else if (auto *cpu = vtkFixedPointVolumeRayCastMapper::SafeDownCast(mapper)) {
+        cpu->SetSampleDistance((float) sample_distance);
+        cpu->SetImageSampleDistance((float) image_sample_distance);
+    }
+}
+
+static void quantized_range(unsigned short center, unsigned short width, unsigned short &low, unsigned short &high) {
+    int margin = (int) (width * (.5 + QUANTIZE_MARGIN)) + 1;
+    low = (unsigned short) std::max(center - margin, 0);
+    high = (unsigned short) std::min(center + margin, (int) MAX_USHORT);
+}
+
 
 void scene::set_transparency_window(unsigned short center, unsigned short width,
                                     double min_opacity, double max_opacity) {
@@ -69,6 +109,13 @@ void scene::set_transparency_window(unsigned short center, unsigned short width,
     transparency_threshold = center - reach;
     opacity_threshold = center + reach;
 
+    // the old quantization stays in use until the new one is done
+    if (quantized && !quantized->covers(transparency_threshold, opacity_threshold)) {
+        unsigned short low, high;
+        quantized_range(center, opacity_threshold - transparency_threshold, low, high);
+        quantized->requantize(low, high);
+    }
+
     std::string projection_mode = get_projection_mode();
 
     // special handling for maximum intensity and additive projections
@@ -77,9 +124,15 @@ void scene::set_transparency_window(unsigned short center, unsigned short width,
         max_opacity /= 2;
     }
 
+    // the CPU can't add up, but compositing with little enough opacity comes close
+    if (projection_mode == "Additive" && engine == render_engine::cpu) {
+        min_opacity /= 8;
+        max_opacity /= 8;
+    }
+
     vtkNew<vtkPiecewiseFunction> opacity;
-    opacity->AddPoint(transparency_threshold, min_opacity);
-    opacity->AddPoint(opacity_threshold, max_opacity);
+    opacity->AddPoint(to_scalar(transparency_threshold), min_opacity);
+    opacity->AddPoint(to_scalar(opacity_threshold), max_opacity);
 
     // special handling for iso surfaces projection
     if (get_projection_mode() == "Iso Surface") {
@@ -89,7 +142,7 @@ void scene::set_transparency_window(unsigned short center, unsigned short width,
                     ((double) (i * iso_step_width) / MAX_USHORT)
                     * (opacity_threshold - transparency_threshold)
                     + transparency_threshold;
-            opacity->AddPoint(relative_intensity, 1. / (iso_steps - i));
+            opacity->AddPoint(to_scalar(relative_intensity), 1. / (iso_steps - i));
         }
     }
 
@@ -134,7 +187,7 @@ void keypress_callback(vtkObject *caller, long unsigned int event_id, void *clie
             adjusted_width = MAX_USHORT - 1;
     }
 
-    scene->set_transparency_window(adjusted_center, adjusted_width);
+    scene->request_transparency_window(adjusted_center, adjusted_width);
 
     // Prior/Next change min/max opacity (can't work, need four buttons)
     // if (key == "Prior") {} else if (key == "Next") {}
@@ -147,8 +200,7 @@ void keypress_callback(vtkObject *caller, long unsigned int event_id, void *clie
     if (key == "r")
         scene->reset_camera();
 
-    scene->compute_legend();
-    scene->refresh();
+    scene->request_render();
 
     // q quits
     if (key == "q") {
@@ -157,23 +209,62 @@ void keypress_callback(vtkObject *caller, long unsigned int event_id, void *clie
     }
 }
 
-scene::scene(unsigned short *data_ptr, unsigned short x, unsigned short y, unsigned short z, std::string meta_data) {
-    // init image data
-    int dt = VTK_UNSIGNED_SHORT;
-    int dt_bytes = sizeof(unsigned short);
+void interaction_callback(vtkObject *caller, long unsigned int event_id, void *client_data, void *call_data) {
+    auto *scene = reinterpret_cast<class scene *>(client_data);
+
+    if (event_id == vtkCommand::StartInteractionEvent)
+        scene->start_interaction();
+    else if (event_id == vtkCommand::EndInteractionEvent)
+        scene->end_interaction();
+}
 
-    size_t slice_bytes = dt_bytes * x * y;
+void timer_callback(vtkObject *caller, long unsigned int event_id, void *client_data, void *call_data) {
+    reinterpret_cast<class scene *>(client_data)->render_frame();
+}
+
+void render_end_callback(vtkObject *caller, long unsigned int event_id, void *client_data, void *call_data) {
+    reinterpret_cast<class scene *>(client_data)->frame_rendered();
+}
+
+scene::scene(unsigned short *data_ptr, unsigned short x, unsigned short y, unsigned short z, std::string meta_data,
+             bool take_ownership, Point3D origin) {
+    scoped_timer timer("scene::scene", sizeof(unsigned short) * x * y * z);
+    // init image data, VTK's memory layout is the same as ours (x fastest, then y, then z),
+    // so instead of copying, we let the image read straight from our buffer
+    scalars = vtkSmartPointer<vtkUnsignedShortArray>::New();
+    scalars->SetNumberOfComponents(1);
+    // save means VTK never frees the buffer, otherwise it gives it back to the volume pool when done
+    scalars->SetArray(data_ptr, (vtkIdType) x * y * z, take_ownership ? 0 : 1, VTK_DATA_ARRAY_USER_DEFINED);
+    if (take_ownership)
+        scalars->SetArrayFreeFunction(volume_pool::release_buffer);
 
     image = vtkSmartPointer<vtkImageData>::New();
     image->SetDimensions(x, y, z);
-
-    image->AllocateScalars(dt, 1);
     image->SetSpacing(1, 1, 1);
-
-    for (int i = 0; i < z; i++)
-        memcpy(image->GetScalarPointer(0, 0, i), data_ptr + (x * y * i), slice_bytes);
+    image->SetOrigin(origin.x, origin.y, origin.z);
+    image->GetPointData()->SetScalars(scalars);
 
     this->meta_data = meta_data;
+    this->origin = origin;
+
+    initial_window_center = MAX_USHORT / 2;
+    initial_window_width = MAX_USHORT / 2;
+
+    window_pending = false;
+    pending_window_center = initial_window_center;
+    pending_window_width = initial_window_width;
+    render_pending = false;
+
+    quantized_upload = false;
+
+    engine = render_engine::gpu;
+    render_threads = 1;
+
+    frame_time_target = 1. / 30;
+    quality_scale = 1;
+    interactive_quality = false;
+    interacting = false;
+    idle_frames = 0;
 
     colors = vtkSmartPointer<vtkNamedColors>::New();
 
@@ -181,45 +272,22 @@ scene::scene(unsigned short *data_ptr, unsigned short x, unsigned short y, unsig
     property->ShadeOn();
     property->SetInterpolationTypeToLinear();
 
-    mapper = vtkSmartPointer<vtkOpenGLGPUVolumeRayCastMapper>::New();
-    mapper->SetInputData(image);
-    mapper->SetBlendModeToComposite();
     projection_mode = 0;
+    mapper = create_mapper();
+    mapper->SetInputData(image);
+    apply_blend_mode(mapper);
+    // both mappers start out with the same
+    base_sample_distance = 1;
 
     volume = vtkSmartPointer<vtkVolume>::New();
     volume->SetMapper(mapper);
     volume->SetProperty(property);
 
-    vtkNew<vtkColorTransferFunction> color;
-    color->RemoveAllPoints();
-    color->AddRGBPoint(USHORT_FAT,
-                       colors->GetColor3d("Flesh").GetData()[0],
-                       colors->GetColor3d("Flesh").GetData()[1],
-                       colors->GetColor3d("Flesh").GetData()[2]);
-    color->AddRGBPoint(USHORT_WATER,
-                       colors->GetColor3d("Blood").GetData()[0],
-                       colors->GetColor3d("Blood").GetData()[1],
-                       colors->GetColor3d("Blood").GetData()[2]);
-    color->AddRGBPoint(USHORT_TISSUE,
-                       colors->GetColor3d("Flesh").GetData()[0],
-                       colors->GetColor3d("Flesh").GetData()[1],
-                       colors->GetColor3d("Flesh").GetData()[2]);
-    color->AddRGBPoint(USHORT_CANCELLOUS_BONE,
-                       colors->GetColor3d("Ivory").GetData()[0],
-                       colors->GetColor3d("Ivory").GetData()[1],
-                       colors->GetColor3d("Ivory").GetData()[2]);
-    color->AddRGBPoint(USHORT_CORTICAL_BONE_UPPER,
-                       colors->GetColor3d("Ivory").GetData()[0],
-                       colors->GetColor3d("Ivory").GetData()[1],
-                       colors->GetColor3d("Ivory").GetData()[2]);
-
-    volume->GetProperty()->SetColor(color);
-
     // set iso surface values in ragular ranges
     iso_steps = 16;
     iso_step_width = std::div(MAX_USHORT, iso_steps - 1).quot;
-    for (int i = 1; i < iso_steps; ++i)
-        volume->GetProperty()->GetIsoSurfaceValues()->SetValue(i, i * iso_step_width);
+
+    map_transfer_functions();
 
     camera = vtkSmartPointer<vtkCamera>::New();
 
@@ -264,29 +332,184 @@ scene::scene(unsigned short *data_ptr, unsigned short x, unsigned short y, unsig
     style = vtkSmartPointer<vtkInteractorStyleTrackballCamera>::New();
     interactor->SetInteractorStyle(style);
 
+    // the style renders again right after the interaction ended, by then at full resolution
+    vtkSmartPointer<vtkCallbackCommand> interaction_cb = vtkSmartPointer<vtkCallbackCommand>::New();
+    interaction_cb->SetCallback(interaction_callback);
+    interaction_cb->SetClientData(this);
+
+    style->AddObserver(vtkCommand::StartInteractionEvent, interaction_cb);
+    style->AddObserver(vtkCommand::EndInteractionEvent, interaction_cb);
+
+    vtkSmartPointer<vtkCallbackCommand> timer_cb = vtkSmartPointer<vtkCallbackCommand>::New();
+    timer_cb->SetCallback(timer_callback);
+    timer_cb->SetClientData(this);
+    interactor->AddObserver(vtkCommand::TimerEvent, timer_cb);
+
+    vtkSmartPointer<vtkCallbackCommand> render_end_cb = vtkSmartPointer<vtkCallbackCommand>::New();
+    render_end_cb->SetCallback(render_end_callback);
+    render_end_cb->SetClientData(this);
+    renderer->AddObserver(vtkCommand::EndEvent, render_end_cb);
+
     info_text = vtkSmartPointer<vtkTextActor>::New();
     info_text->SetInput("");
     info_text->SetPosition(5, 5);
     info_text->GetTextProperty()->SetFontSize(12);
     info_text->GetTextProperty()->SetColor(colors->GetColor3d("Gold").GetData());
     renderer->AddActor2D(info_text);
+
+    // ready long before anybody grabs the mouse, usually
+    pyramid = std::make_shared<volume_pyramid>(data_ptr, x, y, z);
 }
 
 int scene::render() {
     reset_camera();
-    set_transparency_window(MAX_USHORT / 2, MAX_USHORT / 2);
+
+    if (quantized_upload) {
+        unsigned short low, high;
+        quantized_range(initial_window_center, initial_window_width, low, high);
+        quantized = std::make_shared<quantized_volume>(scalars->GetPointer(0), (size_t) scalars->GetNumberOfTuples());
+        quantized->quantize(low, high);
+        upload_quantized();
+        map_transfer_functions();
+    }
+
+    set_transparency_window(initial_window_center, initial_window_width);
     compute_legend();
     camera_widget->On();
     interactor->Initialize();
+    // the scheduler gets a look at what happened once per frame
+    interactor->CreateRepeatingTimer((unsigned long) std::max(frame_time_target * 1000, 1.));
     interactor->Start();
     return EXIT_SUCCESS;
 }
 
+void scene::set_initial_transparency_window(unsigned short center, unsigned short width) {
+    initial_window_center = center;
+    initial_window_width = width;
+}
+
+void scene::request_transparency_window(unsigned short center, unsigned short width) {
+    window_pending = true;
+    pending_window_center = center;
+    pending_window_width = width;
+}
+
+void scene::request_render() {
+    render_pending = true;
+}
+
+void scene::set_frame_hook(std::function<void(scene &)> hook) {
+    frame_hook = std::move(hook);
+}
+
+void scene::set_status(const std::string &status) {
+    if (status == this->status)
+        return;
+
+    this->status = status;
+    render_pending = true;
+}
+
+void scene::update_data(const std::function<bool()> &write) {
+    // the pyramid and the quantization both read the data in the background
+    drop_coarse_volume();
+    pyramid.reset();
+    if (quantized)
+        quantized->wait();
+
+    bool complete = write();
+
+    scalars->Modified();
+    if (quantized) {
+        quantized->quantize(quantized->get_low(), quantized->get_high());
+        upload_quantized();
+    } else {
+        image->Modified();
+    }
+
+    // only worth building for data that stays
+    if (complete) {
+        int *dimensions = image->GetDimensions();
+        pyramid = std::make_shared<volume_pyramid>(scalars->GetPointer(0),
+                                                   dimensions[0], dimensions[1], dimensions[2]);
+    }
+
+    render_pending = true;
+}
+
+void scene::drop_coarse_volume() {
+    if (!coarse_volume)
+        return;
+
+    renderer->RemoveVolume(coarse_volume);
+    volume->VisibilityOn();
+    coarse_volume = nullptr;
+    coarse_mapper = nullptr;
+    coarse_image = nullptr;
+    coarse_quantized.reset();
+}
+
+void scene::set_frame_time_target(double seconds) {
+    frame_time_target = seconds;
+}
+
+void scene::set_quantized_upload(bool enabled) {
+    quantized_upload = enabled;
+}
+
+double scene::to_scalar(double value) const {
+    return quantized ? quantized->to_quantized(value) : value;
+}
+
+void scene::map_transfer_functions() {
+    vtkNew<vtkColorTransferFunction> color;
+    color->RemoveAllPoints();
+    color->AddRGBPoint(to_scalar(USHORT_FAT),
+                       colors->GetColor3d("Flesh").GetData()[0],
+                       colors->GetColor3d("Flesh").GetData()[1],
+                       colors->GetColor3d("Flesh").GetData()[2]);
+    color->AddRGBPoint(to_scalar(USHORT_WATER),
+                       colors->GetColor3d("Blood").GetData()[0],
+                       colors->GetColor3d("Blood").GetData()[1],
+                       colors->GetColor3d("Blood").GetData()[2]);
+    color->AddRGBPoint(to_scalar(USHORT_TISSUE),
+                       colors->GetColor3d("Flesh").GetData()[0],
+                       colors->GetColor3d("Flesh").GetData()[1],
+                       colors->GetColor3d("Flesh").GetData()[2]);
+    color->AddRGBPoint(to_scalar(USHORT_CANCELLOUS_BONE),
+                       colors->GetColor3d("Ivory").GetData()[0],
+                       colors->GetColor3d("Ivory").GetData()[1],
+                       colors->GetColor3d("Ivory").GetData()[2]);
+    color->AddRGBPoint(to_scalar(USHORT_CORTICAL_BONE_UPPER),
+                       colors->GetColor3d("Ivory").GetData()[0],
+                       colors->GetColor3d("Ivory").GetData()[1],
+                       colors->GetColor3d("Ivory").GetData()[2]);
+
+    volume->GetProperty()->SetColor(color);
+
+    for (int i = 1; i < iso_steps; ++i)
+        volume->GetProperty()->GetIsoSurfaceValues()->SetValue(i, to_scalar(i * iso_step_width));
+}
+
+void scene::upload_quantized() {
+    set_quantized_scalars(image, *quantized);
+
+    if (coarse_quantized) {
+        coarse_quantized->quantize(quantized->get_low(), quantized->get_high());
+        set_quantized_scalars(coarse_image, *coarse_quantized);
+    }
+}
+
 unsigned short scene::get_transparency_window_center() {
+    // key events build on the window they asked for, not on the one last rendered
+    if (window_pending)
+        return pending_window_center;
     return std::div((transparency_threshold + opacity_threshold), 2).quot;
 }
 
 unsigned short scene::get_transparency_window_width() {
+    if (window_pending)
+        return pending_window_width;
     return (opacity_threshold - transparency_threshold) + 1;
 }
 
@@ -295,6 +518,9 @@ void scene::refresh() {
 }
 
 void scene::quit() {
+    // the image may free the data the pyramid is still reading
+    pyramid.reset();
+
     interactor->RemoveAllObservers();
     window->Finalize();
     interactor->TerminateApp();
@@ -319,26 +545,77 @@ std::string scene::toggle_projection_mode() {
 
     switch (projection_mode) {
         case 0:
-            mapper->SetBlendModeToComposite();
             mode_string.append("Composite");
             break;
         case 1:
-            mapper->SetBlendModeToMaximumIntensity();
             mode_string.append("Maximum Intensity");
             break;
         case 2:
-            mapper->SetBlendModeToIsoSurface();
             mode_string.append("Iso Surface");
             break;
         case 3:
-            mapper->SetBlendModeToAdditive();
             mode_string.append("Additive");
             break;
     }
 
+    apply_blend_mode(mapper);
+    if (coarse_mapper)
+        apply_blend_mode(coarse_mapper);
+
     return mode_string;
 }
 
+void scene::use_renderer(render_engine engine, unsigned short threads) {
+    this->engine = engine;
+    render_threads = threads;
+
+    // nothing was uploaded yet, so swapping is free
+    mapper = create_mapper();
+    mapper->SetInputData(image);
+    apply_blend_mode(mapper);
+    volume->SetMapper(mapper);
+}
+
+vtkSmartPointer<vtkVolumeMapper> scene::create_mapper() const {
+    // the scheduler picks the sample distances itself
+    if (engine == render_engine::cpu) {
+        vtkSmartPointer<vtkFixedPointVolumeRayCastMapper> cpu = vtkSmartPointer<vtkFixedPointVolumeRayCastMapper>::New();
+        cpu->SetNumberOfThreads(render_threads);
+        cpu->AutoAdjustSampleDistancesOff();
+        return cpu;
+    }
+
+    vtkSmartPointer<vtkOpenGLGPUVolumeRayCastMapper> gpu = vtkSmartPointer<vtkOpenGLGPUVolumeRayCastMapper>::New();
+    gpu->AutoAdjustSampleDistancesOff();
+    return gpu;
+}
+
+void scene::apply_blend_mode(vtkVolumeMapper *target) const {
+    bool cpu = engine == render_engine::cpu;
+
+    switch (projection_mode) {
+        case 0:
+            target->SetBlendModeToComposite();
+            break;
+        case 1:
+            target->SetBlendModeToMaximumIntensity();
+            break;
+        case 2:
+            // the opacity steps of set_transparency_window make the shells
+            if (cpu)
+                target->SetBlendModeToComposite();
+            else
+                target->SetBlendModeToIsoSurface();
+            break;
+        case 3:
+            if (cpu)
+                target->SetBlendModeToComposite();
+            else
+                target->SetBlendModeToAdditive();
+            break;
+    }
+}
+
 std::string scene::get_projection_mode() const {
     std::string mode_string;
     switch (projection_mode) {
@@ -375,7 +652,16 @@ std::string scene::compute_window_info_text() {
             .append("\n")
 
             .append("Projection Mode: ")
-            .append(get_projection_mode());
+            .append(get_projection_mode())
+            .append("\n")
+
+            .append("Frame Time: ")
+            .append(std::to_string((int) std::lround(renderer->GetLastRenderTimeInSeconds() * 1000)))
+            .append(" ms")
+            .append(engine == render_engine::cpu ? " (CPU)" : "");
+
+    if (!status.empty())
+        info_string.append("\n").append(status);
 
     return info_string;
 }
@@ -385,3 +671,129 @@ void scene::reset_camera() {
     camera->SetDistance(cd);
     camera->SetViewUp(0, 0, 1);
 }
+
+void scene::start_interaction() {
+    interacting = true;
+
+    // there's none while the data is still changing
+    size_t level = pyramid ? pyramid->get_interactive_level() : 0;
+    if (level == 0 || !pyramid->is_ready(level)) {
+        set_quality(true);
+        return;
+    }
+
+    if (!coarse_volume) {
+        pyramid_level &coarse = pyramid->get_level(level);
+
+        vtkNew<vtkUnsignedShortArray> coarse_scalars;
+        coarse_scalars->SetNumberOfComponents(1);
+        coarse_scalars->SetArray(coarse.data.data(), (vtkIdType) coarse.data.size(), 1);
+
+        // a coarse voxel sits in the middle of the block it stands for
+        double offset = (coarse.factor - 1) / 2.;
+        coarse_image = vtkSmartPointer<vtkImageData>::New();
+        coarse_image->SetDimensions(coarse.x, coarse.y, coarse.z);
+        coarse_image->SetSpacing(coarse.factor, coarse.factor, coarse.factor);
+        coarse_image->SetOrigin(origin.x + offset, origin.y + offset, origin.z + offset);
+        coarse_image->GetPointData()->SetScalars(coarse_scalars);
+
+        // has to be quantized the same way as the full volume, since they share the transfer functions
+        if (quantized) {
+            coarse_quantized = std::make_shared<quantized_volume>(coarse.data.data(), coarse.data.size());
+            coarse_quantized->quantize(quantized->get_low(), quantized->get_high());
+            set_quantized_scalars(coarse_image, *coarse_quantized);
+        }
+
+        coarse_mapper = create_mapper();
+        coarse_mapper->SetInputData(coarse_image);
+        apply_blend_mode(coarse_mapper);
+
+        coarse_volume = vtkSmartPointer<vtkVolume>::New();
+        coarse_volume->SetMapper(coarse_mapper);
+        coarse_volume->SetProperty(volume->GetProperty());
+        coarse_volume->VisibilityOff();
+        renderer->AddVolume(coarse_volume);
+    }
+
+    // both stay on the GPU, so switching doesn't upload anything
+    volume->VisibilityOff();
+    coarse_volume->VisibilityOn();
+    set_quality(true);
+}
+
+void scene::end_interaction() {
+    interacting = false;
+    set_quality(false);
+
+    if (!coarse_volume)
+        return;
+
+    coarse_volume->VisibilityOff();
+    volume->VisibilityOn();
+}
+
+void scene::render_frame() {
+    if (frame_hook)
+        frame_hook(*this);
+
+    // a new quantization needs the transfer functions moved along, and a render
+    if (quantized && quantized->collect()) {
+        upload_quantized();
+        map_transfer_functions();
+        if (!window_pending)
+            request_transparency_window(get_transparency_window_center(), get_transparency_window_width());
+    }
+
+    if (window_pending) {
+        window_pending = false;
+        set_transparency_window(pending_window_center, pending_window_width);
+        render_pending = true;
+    }
+
+    if (render_pending) {
+        render_pending = false;
+        idle_frames = 0;
+        compute_legend();
+        set_quality(true);
+        refresh();
+        return;
+    }
+
+    // the style renders drags on its own, and ends them at full quality
+    if (!interactive_quality || interacting)
+        return;
+
+    if (++idle_frames * frame_time_target >= IDLE_SECONDS) {
+        set_quality(false);
+        refresh();
+    }
+}
+
+void scene::frame_rendered() {
+    adapt_quality();
+    // shows up with the next frame
+    compute_legend();
+}
+
+void scene::adapt_quality() {
+    if (!interactive_quality)
+        return;
+
+    // the cost of a frame goes with the cube of the scale, image samples in two dimensions and depth samples in one
+    double seconds = renderer->GetLastRenderTimeInSeconds();
+    if (seconds > 0) {
+        quality_scale = std::clamp(quality_scale * std::cbrt(seconds / frame_time_target), 1., MAX_QUALITY_SCALE);
+        set_quality(true);
+    }
+}
+
+void scene::set_quality(bool interactive) {
+    interactive_quality = interactive;
+    double scale = interactive ? quality_scale : 1;
+
+    set_sample_distances(mapper, base_sample_distance * scale, scale);
+
+    // the coarse voxels are bigger, so are its samples
+    if (coarse_mapper)
+        set_sample_distances(coarse_mapper, base_sample_distance * coarse_image->GetSpacing()[0] * scale, scale);
+}
@@ -7,6 +7,8 @@
 
 
 #include <cmath>
+#include <memory>
+#include <functional>
 
 #include <vtkNew.h>
 #include <vtkNamedColors.h>
@@ -18,9 +20,10 @@
 #include <vtkRenderer.h>
 
 #include <vtkPolyDataMapper.h>
-#include <vtkOpenGLGPUVolumeRayCastMapper.h>
+#include <vtkVolumeMapper.h>
 
 #include <vtkImageData.h>
+#include <vtkUnsignedShortArray.h>
 #include <vtkVolume.h>
 #include <vtkVolumeProperty.h>
 
@@ -30,13 +33,19 @@
 
 #include "scene.hpp"
 #include "convenience.hpp"
+#include "volume_pyramid.hpp"
+#include "quantized_volume.hpp"
 
 
 class scene {
 public:
+    // the data is not copied, so it has to outlive the scene, unless the scene takes ownership,
+    // origin is where the first voxel sits, for data that was cropped out of a bigger volume
     scene(unsigned short *data_ptr,
           unsigned short x, unsigned short y, unsigned short z,
-          std::string meta_data = "");
+          std::string meta_data = "",
+          bool take_ownership = false,
+          Point3D origin = Point3D{0, 0, 0});
 
     scene(scene &from) = default;
 
@@ -50,6 +59,34 @@ public:
 
     void set_transparency_window(unsigned short center, unsigned short width, double min_opacity = 0, double max_opacity = 1);
 
+    // the window render() starts with, instead of the middle of the range
+    void set_initial_transparency_window(unsigned short center, unsigned short width);
+
+    // changes the window with the next frame, so a burst of key events only renders once
+    void request_transparency_window(unsigned short center, unsigned short width);
+
+    void request_render();
+
+    // for data that is still coming in, called at the start of every frame
+    void set_frame_hook(std::function<void(scene &)> hook);
+
+    // shown below the legend, until it is set back to ""
+    void set_status(const std::string &status);
+
+    // write changes the data, and says whether that was the last change,
+    // nothing else reads the data while it runs, and the next frame shows the result
+    void update_data(const std::function<bool()> &write);
+
+    // while interacting, quality is lowered until frames take no longer than this
+    void set_frame_time_target(double seconds);
+
+    // has to be called before render, threads are only used by the CPU
+    void use_renderer(render_engine engine, unsigned short threads);
+
+    // upload 8 bits per voxel instead of 16, quantized around the transparency window,
+    // and quantized again in the background whenever the window leaves that range
+    void set_quantized_upload(bool enabled);
+
     std::string get_projection_mode() const;
 
     std::string toggle_projection_mode();
@@ -60,6 +97,18 @@ public:
 
     void reset_camera();
 
+    // while the camera moves, a coarser level of the pyramid is rendered instead, once it is built
+    void start_interaction();
+
+    void end_interaction();
+
+    // called once per frame, renders whatever was requested since the last one,
+    // or at full quality once nothing happened for a while
+    void render_frame();
+
+    // after every render, to adapt the quality of the next one, and show how long it took
+    void frame_rendered();
+
     void refresh();
 
     void quit();
@@ -70,11 +119,51 @@ protected:
     unsigned short transparency_threshold;
     unsigned short opacity_threshold;
 
+    unsigned short initial_window_center;
+    unsigned short initial_window_width;
+
+    bool window_pending;
+    unsigned short pending_window_center;
+    unsigned short pending_window_width;
+    bool render_pending;
+
+    // quality_scale stretches the sample distances of interactive frames, 1 is full quality
+    double frame_time_target;
+    double base_sample_distance;
+    double quality_scale;
+    bool interactive_quality;
+    bool interacting;
+    unsigned int idle_frames;
+
+    void set_quality(bool interactive);
+    void adapt_quality();
+
+    std::function<void(scene &)> frame_hook;
+    std::string status;
+    // the coarse level no longer matches the data, it's made again on the next interaction
+    void drop_coarse_volume();
+
+    render_engine engine;
+    unsigned short render_threads;
+
+    vtkSmartPointer<vtkVolumeMapper> create_mapper() const;
+    // the CPU can only do composite and maximum intensity, and stands in for the others with composite
+    void apply_blend_mode(vtkVolumeMapper *target) const;
+
+    bool quantized_upload;
+
+    // where a value of the volume ends up in the data the GPU gets
+    double to_scalar(double value) const;
+    // the colors and iso values are fixed values of the volume, so they move with the quantization
+    void map_transfer_functions();
+    void upload_quantized();
+
     unsigned short iso_steps;
     unsigned short iso_step_width;
 
     std::string meta_data;
     char projection_mode;
+    Point3D origin;
 
     vtkSmartPointer<vtkNamedColors> colors;
     vtkSmartPointer<vtkRenderer> renderer;
@@ -85,16 +174,28 @@ protected:
     vtkSmartPointer<vtkCamera> camera;
     vtkSmartPointer<vtkCameraOrientationWidget> camera_widget;
 
+    // the volume itself, which stays around even if the image gets a quantized copy
+    vtkSmartPointer<vtkUnsignedShortArray> scalars;
     vtkSmartPointer<vtkImageData> image;
     vtkSmartPointer<vtkVolume> volume;
-    vtkSmartPointer<vtkOpenGLGPUVolumeRayCastMapper> mapper;
+    vtkSmartPointer<vtkVolumeMapper> mapper;
     vtkSmartPointer<vtkTextActor> info_text;
 
+    // the level rendered while interacting, sharing the property of the full volume
+    vtkSmartPointer<vtkImageData> coarse_image;
+    vtkSmartPointer<vtkVolume> coarse_volume;
+    vtkSmartPointer<vtkVolumeMapper> coarse_mapper;
+
 
     double cx;
     double cy;
     double cz;
     double cd;
+
+    // last, so they stop reading the data before the scalars can free it
+    std::shared_ptr<quantized_volume> quantized;
+    std::shared_ptr<quantized_volume> coarse_quantized;
+    std::shared_ptr<volume_pyramid> pyramid;
 };
 
 
@@ -0,0 +1,155 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+
+#include "series_index.hpp"
+
+namespace fs = std::filesystem;
+
+
+static const char INDEX_MAGIC[8] = {'D', 'U', 'M', 'B', 'I', 'D', 'X', '\0'};
+static const uint32_t INDEX_VERSION = 2;
+
+
+series_index::series_index(const string &index_path) : path(index_path) {}
+
+bool series_index::load() {
+    // one read for the whole folder, which is the point on a network share
+    ifstream file(path, ios::binary);
+    if (!file)
+        return false;
+
+    // sizes in a broken index may be anything, so nothing may claim more than what's left of the file
+    error_code error;
+    uintmax_t left = fs::file_size(path, error);
+    if (error || left < sizeof(index_header))
+        return false;
+    left -= sizeof(index_header);
+
+    index_header header{};
+    file.read(reinterpret_cast<char *>(&header), sizeof(index_header));
+    if (!file || memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header.version != INDEX_VERSION
+        || header.entry_count > left / sizeof(index_entry))
+        return false;
+
+    unordered_map<string, known_file> loaded;
+    for (uint64_t i = 0; i < header.entry_count; i++) {
+        index_entry entry{};
+        file.read(reinterpret_cast<char *>(&entry), sizeof(index_entry));
+        if (!file || left < sizeof(index_entry))
+            return false;
+        left -= sizeof(index_entry);
+
+        uintmax_t strings_size = (uintmax_t) entry.name_size + entry.series_size + entry.meta_size;
+        if (strings_size > left)
+            return false;
+        left -= strings_size;
+
+        string name(entry.name_size, '\0');
+        string series(entry.series_size, '\0');
+        string meta_data(entry.meta_size, '\0');
+        file.read(name.data(), entry.name_size);
+        file.read(series.data(), entry.series_size);
+        file.read(meta_data.data(), entry.meta_size);
+        if (!file)
+            return false;
+
+        slice_header known;
+        known.readable = entry.readable;
+        known.is_image = entry.is_image;
+        known.series = series;
+        known.rows = entry.rows;
+        known.cols = entry.cols;
+        known.has_instance = entry.has_instance;
+        known.instance = entry.instance;
+        known.has_position = entry.has_position;
+        memcpy(known.position, entry.position, sizeof(known.position));
+        known.has_orientation = entry.has_orientation;
+        memcpy(known.orientation, entry.orientation, sizeof(known.orientation));
+        known.pixel_offset = entry.pixel_offset;
+        known.meta_data = meta_data;
+
+        loaded[name] = known_file{entry.size, entry.mtime, known};
+    }
+
+    files.swap(loaded);
+    return true;
+}
+
+bool series_index::find(const file_stamp &stamp, slice_header &header) const {
+    auto found = files.find(stamp.name);
+    if (found == files.end() || found->second.size != stamp.size || found->second.mtime != stamp.mtime)
+        return false;
+
+    // the path is the caller's, the index only knows the name
+    string file = header.file;
+    header = found->second.header;
+    header.file = file;
+    return true;
+}
+
+bool series_index::store(const vector<file_stamp> &stamps, const vector<slice_header> &headers) {
+    index_header out{};
+    memcpy(out.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    out.version = INDEX_VERSION;
+    out.entry_count = stamps.size();
+
+    // write to a temporary file first, so a crash never leaves a broken index
+    string tmp_path = path + ".tmp";
+    ofstream file(tmp_path, ios::binary | ios::trunc);
+    if (!file)
+        return false;
+
+    file.write(reinterpret_cast<const char *>(&out), sizeof(index_header));
+
+    for (size_t i = 0; i < stamps.size(); i++) {
+        const slice_header &header = headers[i];
+
+        index_entry entry{};
+        entry.size = stamps[i].size;
+        entry.mtime = stamps[i].mtime;
+        entry.pixel_offset = header.pixel_offset;
+        memcpy(entry.position, header.position, sizeof(entry.position));
+        memcpy(entry.orientation, header.orientation, sizeof(entry.orientation));
+        entry.instance = header.instance;
+        entry.rows = header.rows;
+        entry.cols = header.cols;
+        entry.readable = header.readable;
+        entry.is_image = header.is_image;
+        entry.has_instance = header.has_instance;
+        entry.has_position = header.has_position;
+        entry.has_orientation = header.has_orientation;
+        entry.name_size = stamps[i].name.size();
+        entry.series_size = header.series.size();
+        entry.meta_size = header.meta_data.size();
+
+        file.write(reinterpret_cast<const char *>(&entry), sizeof(index_entry));
+        file.write(stamps[i].name.data(), (streamsize) stamps[i].name.size());
+        file.write(header.series.data(), (streamsize) header.series.size());
+        file.write(header.meta_data.data(), (streamsize) header.meta_data.size());
+    }
+
+    file.close();
+
+    error_code error;
+    if (!file) {
+        fs::remove(tmp_path, error);
+        return false;
+    }
+
+    fs::rename(tmp_path, path, error);
+    if (error) {
+        fs::remove(tmp_path, error);
+        return false;
+    }
+
+    return true;
+}
+
+size_t series_index::get_size() const {
+    return files.size();
+}
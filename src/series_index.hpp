@@ -0,0 +1,104 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_SERIES_INDEX_HPP
+#define ABGABE_CG_VIS_SERIES_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+
+using namespace std;
+
+
+// a file as the directory listing sees it, enough to tell whether it changed
+struct file_stamp {
+    string name;
+    uintmax_t size;
+    int64_t mtime;
+};
+
+
+// what the prescan finds out about a file, without touching its pixels
+struct slice_header {
+    string file;
+    // a file that couldn't be read may just not be there yet, unlike one that's no image
+    bool readable = false;
+    bool is_image = false;
+    string series;
+    uint16_t rows = 0;
+    uint16_t cols = 0;
+    bool has_instance = false;
+    int32_t instance = 0;
+    bool has_position = false;
+    double position[3] = {0, 0, 0};
+    bool has_orientation = false;
+    double orientation[6] = {0, 0, 0, 0, 0, 0};
+    // where the raw pixels start in the file, 0 if they have to go through DCMTK
+    uint64_t pixel_offset = 0;
+    string meta_data;
+};
+
+
+// on disk layout of an index file, followed by entry_count entries
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entry_count;
+};
+
+// followed by the file name, the series UID and the meta data, in that order
+struct index_entry {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t pixel_offset;
+    double position[3];
+    double orientation[6];
+    int32_t instance;
+    uint16_t rows;
+    uint16_t cols;
+    uint8_t is_image;
+    uint8_t has_instance;
+    uint8_t has_position;
+    uint8_t has_orientation;
+    uint32_t name_size;
+    uint32_t series_size;
+    uint32_t meta_size;
+    uint8_t readable;
+    uint8_t reserved[3];
+};
+
+
+// the prescan results of a folder, so opening it again only needs the listing,
+// and files that changed since are the only ones read again
+class series_index {
+public:
+    explicit series_index(const string &index_path);
+
+    // reads the index file, if there is one
+    bool load();
+    // the header of a file, if it's in the index, and didn't change since
+    bool find(const file_stamp &stamp, slice_header &header) const;
+    // writes a new index file, replacing the old one atomically,
+    // files that couldn't be read are kept too, so they aren't tried again until they change
+    bool store(const vector<file_stamp> &stamps, const vector<slice_header> &headers);
+
+    size_t get_size() const;
+protected:
+    string path;
+
+    struct known_file {
+        uintmax_t size;
+        int64_t mtime;
+        slice_header header;
+    };
+
+    unordered_map<string, known_file> files;
+};
+
+
+#endif //ABGABE_CG_VIS_SERIES_INDEX_HPP
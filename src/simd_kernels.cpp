@@ -0,0 +1,601 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <bit>
+#include <atomic>
+#include <algorithm>
+
+#include "simd_kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DUMBICOM_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+// scalar reference versions, also used for the tails the vector versions leave over
+
+static void threshold_scalar(unsigned short *ptr, size_t count, unsigned short threshold) {
+    for (size_t i = 0; i < count; ++i)
+        *(ptr + i) = (*(ptr + i) < threshold) ? 0 : -1;
+}
+
+static void and_scalar(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        *(ptr + i) &= *(other_ptr + i);
+}
+
+static void or_scalar(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        *(ptr + i) |= *(other_ptr + i);
+}
+
+static void min_max_scalar(const unsigned short *ptr, size_t count, unsigned short &min, unsigned short &max) {
+    unsigned short local_min = min;
+    unsigned short local_max = max;
+
+    for (size_t i = 0; i < count; ++i) {
+        unsigned short val = *(ptr + i);
+        local_min = (val < local_min) ? val : local_min;
+        local_max = (val > local_max) ? val : local_max;
+    }
+
+    min = local_min;
+    max = local_max;
+}
+
+static void scale_scalar(unsigned short *ptr, size_t count, unsigned short offset, unsigned short factor) {
+    for (size_t i = 0; i < count; ++i)
+        *(ptr + i) = (unsigned short) ((*(ptr + i) - offset) * factor);
+}
+
+static void shift_left_scalar(unsigned short *ptr, size_t count, unsigned short bits) {
+    for (size_t i = 0; i < count; ++i)
+        *(ptr + i) <<= bits;
+}
+
+static void threshold_bits_scalar(const unsigned short *ptr, size_t count, unsigned short threshold, uint64_t *bits) {
+    for (size_t word = 0; word * 64 < count; ++word) {
+        uint64_t packed = 0;
+        size_t end = min<size_t>(64, count - word * 64);
+        for (size_t i = 0; i < end; ++i)
+            packed |= (uint64_t) (*(ptr + word * 64 + i) >= threshold) << i;
+        bits[word] = packed;
+    }
+}
+
+static void and_bits_scalar(unsigned short *ptr, size_t count, const uint64_t *bits) {
+    for (size_t i = 0; i < count; ++i)
+        if (!((bits[i / 64] >> (i % 64)) & 1))
+            *(ptr + i) = 0;
+}
+
+// quantizing is ((min(x - low, range) << shift) * factor) >> 16, all in 16 bit lanes,
+// the shift takes the range up to the top bit, so that factor (rounded up) fits 16 bits, and hits 255 exactly
+struct quantize_params {
+    unsigned short low;
+    unsigned short range;
+    unsigned short shift;
+    unsigned short factor;
+};
+
+static quantize_params quantize_params_for(unsigned short low, unsigned short high) {
+    unsigned short range = high > low ? high - low : 1;
+    unsigned short shift = 16 - bit_width(range);
+    unsigned int wide = (unsigned int) range << shift;
+    return quantize_params{low, range, shift, (unsigned short) ((255u * 65536 + wide - 1) / wide)};
+}
+
+static void quantize_scalar(const unsigned short *ptr, size_t count, unsigned short low, unsigned short high,
+                            unsigned char *out) {
+    quantize_params q = quantize_params_for(low, high);
+    for (size_t i = 0; i < count; ++i) {
+        unsigned short x = *(ptr + i);
+        unsigned int d = std::min<unsigned int>(x > q.low ? x - q.low : 0, q.range) << q.shift;
+        *(out + i) = (unsigned char) ((d * q.factor) >> 16);
+    }
+}
+
+
+#ifdef DUMBICOM_X86_SIMD
+
+static void reduce_lanes(const unsigned short *lanes_min, const unsigned short *lanes_max, size_t count,
+                         unsigned short &min, unsigned short &max) {
+    // the lanes started out as min and max, so they can't make things worse
+    for (size_t i = 0; i < count; ++i) {
+        min = (lanes_min[i] < min) ? lanes_min[i] : min;
+        max = (lanes_max[i] > max) ? lanes_max[i] : max;
+    }
+}
+
+
+// SSE4.2 capable CPUs, the unsigned 16 bit min/max are actually from SSE4.1
+
+__attribute__((target("sse4.2")))
+static void threshold_sse42(unsigned short *ptr, size_t count, unsigned short threshold) {
+    // there is no unsigned compare, but x >= t exactly when max(x, t) == x
+    __m128i t = _mm_set1_epi16((short) threshold);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        __m128i over = _mm_cmpeq_epi16(_mm_max_epu16(x, t), x);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr + i), over);
+    }
+    threshold_scalar(ptr + i, count - i, threshold);
+}
+
+__attribute__((target("sse4.2")))
+static void and_sse42(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other_ptr + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr + i), _mm_and_si128(x, y));
+    }
+    and_scalar(ptr + i, other_ptr + i, count - i);
+}
+
+__attribute__((target("sse4.2")))
+static void or_sse42(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other_ptr + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr + i), _mm_or_si128(x, y));
+    }
+    or_scalar(ptr + i, other_ptr + i, count - i);
+}
+
+__attribute__((target("sse4.2")))
+static void min_max_sse42(const unsigned short *ptr, size_t count, unsigned short &min, unsigned short &max) {
+    __m128i vmin = _mm_set1_epi16((short) min);
+    __m128i vmax = _mm_set1_epi16((short) max);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        vmin = _mm_min_epu16(vmin, x);
+        vmax = _mm_max_epu16(vmax, x);
+    }
+
+    alignas(16) unsigned short lanes_min[8];
+    alignas(16) unsigned short lanes_max[8];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes_min), vmin);
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes_max), vmax);
+    reduce_lanes(lanes_min, lanes_max, 8, min, max);
+    min_max_scalar(ptr + i, count - i, min, max);
+}
+
+__attribute__((target("sse4.2")))
+static void scale_sse42(unsigned short *ptr, size_t count, unsigned short offset, unsigned short factor) {
+    __m128i o = _mm_set1_epi16((short) offset);
+    __m128i f = _mm_set1_epi16((short) factor);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        x = _mm_mullo_epi16(_mm_sub_epi16(x, o), f);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr + i), x);
+    }
+    scale_scalar(ptr + i, count - i, offset, factor);
+}
+
+__attribute__((target("sse4.2")))
+static void shift_left_sse42(unsigned short *ptr, size_t count, unsigned short bits) {
+    __m128i b = _mm_cvtsi32_si128(bits);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr + i), _mm_sll_epi16(x, b));
+    }
+    shift_left_scalar(ptr + i, count - i, bits);
+}
+
+__attribute__((target("sse4.2")))
+static void threshold_bits_sse42(const unsigned short *ptr, size_t count, unsigned short threshold, uint64_t *bits) {
+    __m128i t = _mm_set1_epi16((short) threshold);
+    size_t word = 0;
+    for (; (word + 1) * 64 <= count; ++word) {
+        uint64_t packed = 0;
+        // 16 voxels to 16 bytes to 16 bits at a time
+        for (size_t i = 0; i < 64; i += 16) {
+            const unsigned short *src = ptr + word * 64 + i;
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 8));
+            a = _mm_cmpeq_epi16(_mm_max_epu16(a, t), a);
+            b = _mm_cmpeq_epi16(_mm_max_epu16(b, t), b);
+            packed |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_packs_epi16(a, b)) << i;
+        }
+        bits[word] = packed;
+    }
+    threshold_bits_scalar(ptr + word * 64, count - word * 64, threshold, bits + word);
+}
+
+__attribute__((target("sse4.2")))
+static void and_bits_sse42(unsigned short *ptr, size_t count, const uint64_t *bits) {
+    // spread 8 bits over 8 lanes, and turn them into whole lane masks
+    const __m128i selectors = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        short byte = (short) ((bits[i / 64] >> (i % 64)) & 0xFF);
+        __m128i lanes = _mm_and_si128(_mm_set1_epi16(byte), selectors);
+        __m128i keep = _mm_cmpeq_epi16(lanes, selectors);
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr + i), _mm_and_si128(x, keep));
+    }
+    for (; i < count; ++i)
+        if (!((bits[i / 64] >> (i % 64)) & 1))
+            *(ptr + i) = 0;
+}
+
+__attribute__((target("sse4.2")))
+static void quantize_sse42(const unsigned short *ptr, size_t count, unsigned short low, unsigned short high,
+                           unsigned char *out) {
+    quantize_params q = quantize_params_for(low, high);
+    __m128i l = _mm_set1_epi16((short) q.low);
+    __m128i r = _mm_set1_epi16((short) q.range);
+    __m128i s = _mm_cvtsi32_si128(q.shift);
+    __m128i f = _mm_set1_epi16((short) q.factor);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + i + 8));
+        a = _mm_mulhi_epu16(_mm_sll_epi16(_mm_min_epu16(_mm_subs_epu16(a, l), r), s), f);
+        b = _mm_mulhi_epu16(_mm_sll_epi16(_mm_min_epu16(_mm_subs_epu16(b, l), r), s), f);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(a, b));
+    }
+    quantize_scalar(ptr + i, count - i, low, high, out + i);
+}
+
+
+// AVX2, same as above, but twice as wide
+
+__attribute__((target("avx2")))
+static void threshold_avx2(unsigned short *ptr, size_t count, unsigned short threshold) {
+    __m256i t = _mm256_set1_epi16((short) threshold);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        __m256i over = _mm256_cmpeq_epi16(_mm256_max_epu16(x, t), x);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr + i), over);
+    }
+    threshold_scalar(ptr + i, count - i, threshold);
+}
+
+__attribute__((target("avx2")))
+static void and_avx2(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(other_ptr + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr + i), _mm256_and_si256(x, y));
+    }
+    and_scalar(ptr + i, other_ptr + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void or_avx2(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(other_ptr + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr + i), _mm256_or_si256(x, y));
+    }
+    or_scalar(ptr + i, other_ptr + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void min_max_avx2(const unsigned short *ptr, size_t count, unsigned short &min, unsigned short &max) {
+    __m256i vmin = _mm256_set1_epi16((short) min);
+    __m256i vmax = _mm256_set1_epi16((short) max);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        vmin = _mm256_min_epu16(vmin, x);
+        vmax = _mm256_max_epu16(vmax, x);
+    }
+
+    alignas(32) unsigned short lanes_min[16];
+    alignas(32) unsigned short lanes_max[16];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes_min), vmin);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes_max), vmax);
+    reduce_lanes(lanes_min, lanes_max, 16, min, max);
+    min_max_scalar(ptr + i, count - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void scale_avx2(unsigned short *ptr, size_t count, unsigned short offset, unsigned short factor) {
+    __m256i o = _mm256_set1_epi16((short) offset);
+    __m256i f = _mm256_set1_epi16((short) factor);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        x = _mm256_mullo_epi16(_mm256_sub_epi16(x, o), f);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr + i), x);
+    }
+    scale_scalar(ptr + i, count - i, offset, factor);
+}
+
+__attribute__((target("avx2")))
+static void shift_left_avx2(unsigned short *ptr, size_t count, unsigned short bits) {
+    __m128i b = _mm_cvtsi32_si128(bits);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr + i), _mm256_sll_epi16(x, b));
+    }
+    shift_left_scalar(ptr + i, count - i, bits);
+}
+
+__attribute__((target("avx2")))
+static void threshold_bits_avx2(const unsigned short *ptr, size_t count, unsigned short threshold, uint64_t *bits) {
+    __m256i t = _mm256_set1_epi16((short) threshold);
+    size_t word = 0;
+    for (; (word + 1) * 64 <= count; ++word) {
+        uint64_t packed = 0;
+        for (size_t i = 0; i < 64; i += 32) {
+            const unsigned short *src = ptr + word * 64 + i;
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 16));
+            a = _mm256_cmpeq_epi16(_mm256_max_epu16(a, t), a);
+            b = _mm256_cmpeq_epi16(_mm256_max_epu16(b, t), b);
+            // packing works per 128 bit lane, the permute puts the quarters back in order
+            __m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+            packed |= (uint64_t) (uint32_t) _mm256_movemask_epi8(bytes) << i;
+        }
+        bits[word] = packed;
+    }
+    threshold_bits_scalar(ptr + word * 64, count - word * 64, threshold, bits + word);
+}
+
+__attribute__((target("avx2")))
+static void and_bits_avx2(unsigned short *ptr, size_t count, const uint64_t *bits) {
+    const __m256i selectors = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096,
+                                                8192, 16384, (short) 32768);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        short half = (short) ((bits[i / 64] >> (i % 64)) & 0xFFFF);
+        __m256i lanes = _mm256_and_si256(_mm256_set1_epi16(half), selectors);
+        __m256i keep = _mm256_cmpeq_epi16(lanes, selectors);
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr + i), _mm256_and_si256(x, keep));
+    }
+    for (; i < count; ++i)
+        if (!((bits[i / 64] >> (i % 64)) & 1))
+            *(ptr + i) = 0;
+}
+
+__attribute__((target("avx2")))
+static void quantize_avx2(const unsigned short *ptr, size_t count, unsigned short low, unsigned short high,
+                          unsigned char *out) {
+    quantize_params q = quantize_params_for(low, high);
+    __m256i l = _mm256_set1_epi16((short) q.low);
+    __m256i r = _mm256_set1_epi16((short) q.range);
+    __m128i s = _mm_cvtsi32_si128(q.shift);
+    __m256i f = _mm256_set1_epi16((short) q.factor);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + i + 16));
+        a = _mm256_mulhi_epu16(_mm256_sll_epi16(_mm256_min_epu16(_mm256_subs_epu16(a, l), r), s), f);
+        b = _mm256_mulhi_epu16(_mm256_sll_epi16(_mm256_min_epu16(_mm256_subs_epu16(b, l), r), s), f);
+        // packing works within 128 bit lanes, so the quarters need sorting afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), packed);
+    }
+    quantize_scalar(ptr + i, count - i, low, high, out + i);
+}
+
+
+// AVX-512, the 16 bit lanes need the BW extension
+
+__attribute__((target("avx512f,avx512bw")))
+static void threshold_avx512(unsigned short *ptr, size_t count, unsigned short threshold) {
+    // AVX-512 does have unsigned compares, the result is a mask register
+    __m512i t = _mm512_set1_epi16((short) threshold);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        __mmask32 over = _mm512_cmpge_epu16_mask(x, t);
+        _mm512_storeu_si512(ptr + i, _mm512_movm_epi16(over));
+    }
+    threshold_scalar(ptr + i, count - i, threshold);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void and_avx512(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        __m512i y = _mm512_loadu_si512(other_ptr + i);
+        _mm512_storeu_si512(ptr + i, _mm512_and_si512(x, y));
+    }
+    and_scalar(ptr + i, other_ptr + i, count - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void or_avx512(unsigned short *ptr, const unsigned short *other_ptr, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        __m512i y = _mm512_loadu_si512(other_ptr + i);
+        _mm512_storeu_si512(ptr + i, _mm512_or_si512(x, y));
+    }
+    or_scalar(ptr + i, other_ptr + i, count - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void min_max_avx512(const unsigned short *ptr, size_t count, unsigned short &min, unsigned short &max) {
+    __m512i vmin = _mm512_set1_epi16((short) min);
+    __m512i vmax = _mm512_set1_epi16((short) max);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        vmin = _mm512_min_epu16(vmin, x);
+        vmax = _mm512_max_epu16(vmax, x);
+    }
+
+    alignas(64) unsigned short lanes_min[32];
+    alignas(64) unsigned short lanes_max[32];
+    _mm512_store_si512(lanes_min, vmin);
+    _mm512_store_si512(lanes_max, vmax);
+    reduce_lanes(lanes_min, lanes_max, 32, min, max);
+    min_max_scalar(ptr + i, count - i, min, max);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scale_avx512(unsigned short *ptr, size_t count, unsigned short offset, unsigned short factor) {
+    __m512i o = _mm512_set1_epi16((short) offset);
+    __m512i f = _mm512_set1_epi16((short) factor);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        x = _mm512_mullo_epi16(_mm512_sub_epi16(x, o), f);
+        _mm512_storeu_si512(ptr + i, x);
+    }
+    scale_scalar(ptr + i, count - i, offset, factor);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void shift_left_avx512(unsigned short *ptr, size_t count, unsigned short bits) {
+    __m128i b = _mm_cvtsi32_si128(bits);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        _mm512_storeu_si512(ptr + i, _mm512_sll_epi16(x, b));
+    }
+    shift_left_scalar(ptr + i, count - i, bits);
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static void threshold_bits_avx512(const unsigned short *ptr, size_t count, unsigned short threshold, uint64_t *bits) {
+    // the compare already gives us the bits
+    __m512i t = _mm512_set1_epi16((short) threshold);
+    size_t word = 0;
+    for (; (word + 1) * 64 <= count; ++word) {
+        __m512i a = _mm512_loadu_si512(ptr + word * 64);
+        __m512i b = _mm512_loadu_si512(ptr + word * 64 + 32);
+        __mmask32 low = _mm512_cmpge_epu16_mask(a, t);
+        __mmask32 high = _mm512_cmpge_epu16_mask(b, t);
+        bits[word] = _cvtmask64_u64(_kunpackd_mask64(high, low));
+    }
+    threshold_bits_scalar(ptr + word * 64, count - word * 64, threshold, bits + word);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void and_bits_avx512(unsigned short *ptr, size_t count, const uint64_t *bits) {
+    // and the bits are already a mask
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __mmask32 keep = (__mmask32) (bits[i / 64] >> (i % 64));
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        _mm512_storeu_si512(ptr + i, _mm512_maskz_mov_epi16(keep, x));
+    }
+    for (; i < count; ++i)
+        if (!((bits[i / 64] >> (i % 64)) & 1))
+            *(ptr + i) = 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void quantize_avx512(const unsigned short *ptr, size_t count, unsigned short low, unsigned short high,
+                            unsigned char *out) {
+    quantize_params q = quantize_params_for(low, high);
+    __m512i l = _mm512_set1_epi16((short) q.low);
+    __m512i r = _mm512_set1_epi16((short) q.range);
+    __m128i s = _mm_cvtsi32_si128(q.shift);
+    __m512i f = _mm512_set1_epi16((short) q.factor);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i x = _mm512_loadu_si512(ptr + i);
+        x = _mm512_mulhi_epu16(_mm512_sll_epi16(_mm512_min_epu16(_mm512_subs_epu16(x, l), r), s), f);
+        // everything fits a byte already, so narrowing just drops the high halves
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm512_cvtepi16_epi8(x));
+    }
+    quantize_scalar(ptr + i, count - i, low, high, out + i);
+}
+
+#endif
+
+
+static const simd_kernels SCALAR_KERNELS{
+        "scalar", threshold_scalar, and_scalar, or_scalar, min_max_scalar, scale_scalar, shift_left_scalar,
+        threshold_bits_scalar, and_bits_scalar, quantize_scalar
+};
+
+#ifdef DUMBICOM_X86_SIMD
+static const simd_kernels SSE42_KERNELS{
+        "sse4.2", threshold_sse42, and_sse42, or_sse42, min_max_sse42, scale_sse42, shift_left_sse42,
+        threshold_bits_sse42, and_bits_sse42, quantize_sse42
+};
+
+static const simd_kernels AVX2_KERNELS{
+        "avx2", threshold_avx2, and_avx2, or_avx2, min_max_avx2, scale_avx2, shift_left_avx2,
+        threshold_bits_avx2, and_bits_avx2, quantize_avx2
+};
+
+static const simd_kernels AVX512_KERNELS{
+        "avx512", threshold_avx512, and_avx512, or_avx512, min_max_avx512, scale_avx512, shift_left_avx512,
+        threshold_bits_avx512, and_bits_avx512, quantize_avx512
+};
+#endif
+
+
+static const simd_kernels *best_kernels() {
+#ifdef DUMBICOM_X86_SIMD
+    // asks CPUID, so it's only worth doing once
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return &AVX512_KERNELS;
+    if (__builtin_cpu_supports("avx2"))
+        return &AVX2_KERNELS;
+    if (__builtin_cpu_supports("sse4.2"))
+        return &SSE42_KERNELS;
+#endif
+    return &SCALAR_KERNELS;
+}
+
+// whatever --simd asked for, until then the best ones are used
+static atomic<const simd_kernels *> chosen{nullptr};
+
+
+const simd_kernels &scalar_kernels() {
+    return SCALAR_KERNELS;
+}
+
+const simd_kernels &active_kernels() {
+    // the first call may well come from some worker thread, the static makes sure it's only worked out once
+    static const simd_kernels &best = *best_kernels();
+    const simd_kernels *kernels = chosen.load(memory_order_acquire);
+    return kernels ? *kernels : best;
+}
+
+bool use_kernels(const string &name) {
+    const simd_kernels *best = best_kernels();
+
+    if (name == "auto") {
+        chosen.store(best, memory_order_release);
+        return true;
+    }
+
+    // from worst to best, anything up to the best supported one goes
+    const simd_kernels *candidates[] = {
+            &SCALAR_KERNELS,
+#ifdef DUMBICOM_X86_SIMD
+            &SSE42_KERNELS,
+            &AVX2_KERNELS,
+            &AVX512_KERNELS,
+#endif
+    };
+
+    for (const simd_kernels *candidate: candidates) {
+        if (candidate->name == name) {
+            chosen.store(candidate, memory_order_release);
+            return true;
+        }
+
+        if (candidate == best)
+            break;
+    }
+
+    return false;
+}
@@ -0,0 +1,52 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_SIMD_KERNELS_HPP
+#define ABGABE_CG_VIS_SIMD_KERNELS_HPP
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+
+using namespace std;
+
+
+// element wise kernels over plain arrays of voxels,
+// every instruction set gets its own table of these
+struct simd_kernels {
+    string name;
+
+    // sets everything under threshold to 0, and everything else to 0xFFFF
+    void (*threshold)(unsigned short *ptr, size_t count, unsigned short threshold);
+    void (*bitwise_and)(unsigned short *ptr, const unsigned short *other_ptr, size_t count);
+    void (*bitwise_or)(unsigned short *ptr, const unsigned short *other_ptr, size_t count);
+    // narrows min and max down to the extremes of the data
+    void (*min_max)(const unsigned short *ptr, size_t count, unsigned short &min, unsigned short &max);
+    // x' = (x - offset) * factor, wrapping around like unsigned short arithmetic does
+    void (*scale)(unsigned short *ptr, size_t count, unsigned short offset, unsigned short factor);
+    void (*shift_left)(unsigned short *ptr, size_t count, unsigned short bits);
+
+    // packs (x >= threshold) into bits, lowest bit first, unused bits of the last word are 0
+    void (*threshold_bits)(const unsigned short *ptr, size_t count, unsigned short threshold, uint64_t *bits);
+    // clears every x whose bit is 0
+    void (*and_bits)(unsigned short *ptr, size_t count, const uint64_t *bits);
+
+    // maps low..high onto 0..255 (rounding down), values outside of it are clamped
+    void (*quantize)(const unsigned short *ptr, size_t count, unsigned short low, unsigned short high, unsigned char *out);
+};
+
+
+// the plain C++ versions, which the others have to agree with
+const simd_kernels &scalar_kernels();
+
+// the kernels for the best instruction set the CPU supports, unless use_kernels picked others
+const simd_kernels &active_kernels();
+
+// picks the kernels by name ("auto", "scalar", "sse4.2", "avx2" or "avx512"),
+// returns false if the name is unknown, or the CPU doesn't support it
+bool use_kernels(const string &name);
+
+
+#endif //ABGABE_CG_VIS_SIMD_KERNELS_HPP
@@ -0,0 +1,96 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <cmath>
+#include <iostream>
+#include <filesystem>
+
+#include <vtkNew.h>
+#include <vtkSmartPointer.h>
+#include <vtkSMPTools.h>
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkPolyData.h>
+#include <vtkUnsignedShortArray.h>
+#include <vtkFlyingEdges3D.h>
+#include <vtkBinnedDecimation.h>
+#include <vtkSTLWriter.h>
+#include <vtkPLYWriter.h>
+
+#include "surface_writer.hpp"
+#include "profiler.hpp"
+
+namespace fs = std::filesystem;
+
+
+bool write_surface(const string &path, unsigned short *data_ptr,
+                   unsigned short x, unsigned short y, unsigned short z,
+                   unsigned short iso, double decimate, unsigned short threads) {
+    size_t voxels = (size_t) x * y * z;
+
+    // flying edges and the binned decimation both run on VTK's SMP tools, if VTK was built with a threaded backend
+    vtkSMPTools::Initialize(threads);
+
+    // VTK only looks at the data, it stays ours
+    vtkNew<vtkUnsignedShortArray> scalars;
+    scalars->SetNumberOfComponents(1);
+    scalars->SetArray(data_ptr, (vtkIdType) voxels, 1);
+
+    vtkNew<vtkImageData> image;
+    image->SetDimensions(x, y, z);
+    image->GetPointData()->SetScalars(scalars);
+
+    vtkNew<vtkFlyingEdges3D> surface;
+    surface->SetInputData(image);
+    surface->SetValue(0, iso);
+    // STL has no use for them, and they'd only make the file bigger
+    surface->ComputeNormalsOff();
+    surface->ComputeGradientsOff();
+    surface->ComputeScalarsOff();
+
+    {
+        scoped_timer timer("surface::extract", sizeof(unsigned short) * voxels, threads);
+        surface->Update();
+    }
+
+    vtkSmartPointer<vtkPolyData> mesh = surface->GetOutput();
+    cout << "Surface: " << mesh->GetNumberOfPolys() << " triangles" << endl;
+
+    if (decimate > 0) {
+        scoped_timer timer("surface::decimate", 0, threads);
+
+        // bins of a fixed size in voxels, so the mesh gets coarser by the same amount everywhere
+        vtkNew<vtkBinnedDecimation> decimation;
+        decimation->SetInputData(mesh);
+        decimation->AutoAdjustNumberOfDivisionsOff();
+        decimation->SetNumberOfDivisions((int) std::ceil(x / decimate),
+                                         (int) std::ceil(y / decimate),
+                                         (int) std::ceil(z / decimate));
+        decimation->Update();
+
+        mesh = decimation->GetOutput();
+        cout << "Decimated: " << mesh->GetNumberOfPolys() << " triangles" << endl;
+    }
+
+    scoped_timer timer("surface::write", 0);
+
+    if (fs::path(path).extension() == ".ply") {
+        vtkNew<vtkPLYWriter> writer;
+        writer->SetInputData(mesh);
+        writer->SetFileName(path.data());
+        writer->SetFileTypeToBinary();
+        return writer->Write() == 1;
+    }
+
+    vtkNew<vtkSTLWriter> writer;
+    writer->SetInputData(mesh);
+    writer->SetFileName(path.data());
+    writer->SetFileTypeToBinary();
+    return writer->Write() == 1;
+}
+
+bool is_surface_path(const string &path) {
+    fs::path extension = fs::path(path).extension();
+    return extension == ".stl" || extension == ".ply";
+}
@@ -0,0 +1,24 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_SURFACE_WRITER_HPP
+#define ABGABE_CG_VIS_SURFACE_WRITER_HPP
+
+#include <string>
+
+
+using namespace std;
+
+
+// extracts the iso surface at iso (in units of the volume) with flying edges, on threads threads,
+// merges vertices within bins of decimate voxels if that's more than 0, and writes the mesh
+// to a binary .stl or .ply file, picked by the extension of path, coordinates are in voxels
+bool write_surface(const string &path, unsigned short *data_ptr,
+                   unsigned short x, unsigned short y, unsigned short z,
+                   unsigned short iso, double decimate, unsigned short threads);
+
+bool is_surface_path(const string &path);
+
+
+#endif //ABGABE_CG_VIS_SURFACE_WRITER_HPP
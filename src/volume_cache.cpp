@@ -0,0 +1,159 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <iostream>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "volume_cache.hpp"
+
+namespace fs = std::filesystem;
+
+
+static const char CACHE_MAGIC[8] = {'D', 'U', 'M', 'B', 'I', 'C', 'O', 'M'};
+static const uint32_t CACHE_VERSION = 1;
+// voxels start on a cache line, so the mapped data is nicely aligned
+static const uint64_t CACHE_ALIGNMENT = 64;
+
+
+volume_cache::volume_cache(const string &cache_path, uint64_t listing_checksum)
+        : path(cache_path),
+          checksum(listing_checksum),
+          mapping(nullptr),
+          mapping_size(0),
+          header(),
+          data_ptr(nullptr) {}
+
+volume_cache::~volume_cache() {
+    if (mapping != nullptr)
+        munmap(mapping, mapping_size);
+}
+
+bool volume_cache::load() {
+    int fd = open(path.data(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(cache_header)) {
+        close(fd);
+        return false;
+    }
+
+    size_t file_size = info.st_size;
+
+    // private and writable, so whoever gets the pointer can scribble on it,
+    // without us ever touching the file
+    void *map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    memcpy(&header, map, sizeof(cache_header));
+
+    // sizes and offsets may be anything in a broken file, so they are checked against what's left,
+    // instead of adding them up, which might wrap around
+    size_t data_bytes = sizeof(unsigned short) * header.cols * header.rows * header.image_count;
+    bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+                 && header.version == CACHE_VERSION
+                 && header.listing_checksum == checksum
+                 && header.data_offset % CACHE_ALIGNMENT == 0
+                 && header.meta_size <= file_size - sizeof(cache_header)
+                 && header.data_offset >= sizeof(cache_header) + header.meta_size
+                 && header.data_offset <= file_size
+                 && data_bytes == file_size - header.data_offset;
+
+    if (!valid) {
+        munmap(map, file_size);
+        return false;
+    }
+
+    // start paging in the voxels in the background, we'll need all of them
+    char *base = static_cast<char *>(map);
+    madvise(base, file_size, MADV_WILLNEED);
+
+    mapping = map;
+    mapping_size = file_size;
+
+    meta_data.assign(base + sizeof(cache_header), header.meta_size);
+    data_ptr = reinterpret_cast<unsigned short *>(base + header.data_offset);
+
+    return true;
+}
+
+bool volume_cache::store(const unsigned short *data_ptr,
+                         unsigned short x, unsigned short y, unsigned short z,
+                         const string &meta_data) {
+    cache_header out{};
+    memcpy(out.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    out.version = CACHE_VERSION;
+    out.cols = x;
+    out.rows = y;
+    out.image_count = z;
+    out.listing_checksum = checksum;
+    out.meta_size = meta_data.size();
+
+    uint64_t unaligned = sizeof(cache_header) + out.meta_size;
+    out.data_offset = (unaligned + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+
+    // write to a temporary file first, so a crash never leaves a broken cache
+    string tmp_path = path + ".tmp";
+    ofstream file(tmp_path, ios::binary | ios::trunc);
+    if (!file)
+        return false;
+
+    string padding(out.data_offset - unaligned, '\0');
+    size_t data_bytes = sizeof(unsigned short) * x * y * z;
+
+    file.write(reinterpret_cast<const char *>(&out), sizeof(cache_header));
+    file.write(meta_data.data(), (streamsize) meta_data.size());
+    file.write(padding.data(), (streamsize) padding.size());
+    file.write(reinterpret_cast<const char *>(data_ptr), (streamsize) data_bytes);
+    file.close();
+
+    error_code error;
+    if (!file) {
+        fs::remove(tmp_path, error);
+        return false;
+    }
+
+    fs::rename(tmp_path, path, error);
+    if (error) {
+        fs::remove(tmp_path, error);
+        return false;
+    }
+
+    return true;
+}
+
+bool volume_cache::is_loaded() const {
+    return mapping != nullptr;
+}
+
+unsigned short *volume_cache::get_data_ptr() {
+    return data_ptr;
+}
+
+const string &volume_cache::get_meta_data() const {
+    return meta_data;
+}
+
+unsigned short volume_cache::get_x() const {
+    return header.cols;
+}
+
+unsigned short volume_cache::get_y() const {
+    return header.rows;
+}
+
+unsigned short volume_cache::get_z() const {
+    return header.image_count;
+}
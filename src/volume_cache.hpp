@@ -0,0 +1,65 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_VOLUME_CACHE_HPP
+#define ABGABE_CG_VIS_VOLUME_CACHE_HPP
+
+#include <string>
+#include <cstdint>
+
+
+using namespace std;
+
+
+// on disk layout of a cache file, followed by the meta data string,
+// and (at data_offset) by the raw voxels, one unsigned short per voxel
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint16_t cols;
+    uint16_t rows;
+    uint16_t image_count;
+    uint16_t reserved;
+    uint64_t listing_checksum;
+    uint64_t meta_size;
+    uint64_t data_offset;
+};
+
+
+class volume_cache {
+public:
+    volume_cache(const string &cache_path, uint64_t listing_checksum);
+    ~volume_cache();
+
+    volume_cache(const volume_cache &) = delete;
+    volume_cache &operator=(const volume_cache &) = delete;
+
+    // maps the cache file, if it exists and belongs to the same listing
+    bool load();
+    // writes a new cache file, replacing the old one atomically
+    bool store(const unsigned short *data_ptr,
+               unsigned short x, unsigned short y, unsigned short z,
+               const string &meta_data);
+
+    bool is_loaded() const;
+    unsigned short *get_data_ptr();
+    const string &get_meta_data() const;
+
+    unsigned short get_x() const;
+    unsigned short get_y() const;
+    unsigned short get_z() const;
+protected:
+    string path;
+    uint64_t checksum;
+
+    void *mapping;
+    size_t mapping_size;
+
+    cache_header header;
+    string meta_data;
+    unsigned short *data_ptr;
+};
+
+
+#endif //ABGABE_CG_VIS_VOLUME_CACHE_HPP
@@ -0,0 +1,143 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include <opencv2/core.hpp>
+
+#include "volume_pool.hpp"
+#include "profiler.hpp"
+
+
+using namespace std;
+
+
+static const size_t POOL_ALIGNMENT = 64;
+static const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+
+static void touch_parallel(void *data_ptr, size_t bytes) {
+    scoped_timer timer("volume_pool::first_touch", bytes, cv::getNumThreads());
+    char *base = static_cast<char *>(data_ptr);
+    int chunks = (int) ((bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES);
+
+    cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &range) {
+        for (int chunk = range.start; chunk < range.end; chunk++) {
+            size_t first = chunk * HUGE_PAGE_BYTES;
+            memset(base + first, 0, std::min(HUGE_PAGE_BYTES, bytes - first));
+        }
+    });
+}
+
+
+volume_pool &volume_pool::instance() {
+    static volume_pool global;
+    return global;
+}
+
+volume_pool::volume_pool() :
+    huge_pages(false),
+    first_touch(false) {}
+
+volume_pool::~volume_pool() {
+    trim();
+}
+
+unsigned short *volume_pool::acquire(size_t fields) {
+    size_t bytes = std::max<size_t>(fields, 1) * sizeof(unsigned short);
+    size_t alignment = huge_pages && bytes >= HUGE_PAGE_BYTES ? HUGE_PAGE_BYTES : POOL_ALIGNMENT;
+    bytes = (bytes + alignment - 1) / alignment * alignment;
+
+    {
+        lock_guard<mutex> guard(lock);
+        // the smallest that fits, as long as it isn't more than twice as big, which would waste too much
+        auto found = kept.lower_bound(bytes);
+        if (found != kept.end() && found->first <= 2 * bytes) {
+            void *data_ptr = found->second;
+            kept.erase(found);
+            return static_cast<unsigned short *>(data_ptr);
+        }
+    }
+
+    void *data_ptr = nullptr;
+    if (posix_memalign(&data_ptr, alignment, bytes) != 0) {
+        cerr << "Can't allocate a volume of " << bytes << " bytes" << endl;
+        exit(35);
+    }
+
+    // only a hint, the kernel may ignore it, and it has to come before the pages are touched
+    if (alignment == HUGE_PAGE_BYTES)
+        madvise(data_ptr, bytes, MADV_HUGEPAGE);
+
+    if (first_touch)
+        touch_parallel(data_ptr, bytes);
+
+    lock_guard<mutex> guard(lock);
+    sizes[data_ptr] = bytes;
+    return static_cast<unsigned short *>(data_ptr);
+}
+
+void volume_pool::release(unsigned short *data_ptr) {
+    if (data_ptr == nullptr)
+        return;
+
+    lock_guard<mutex> guard(lock);
+    auto found = sizes.find(data_ptr);
+    if (found == sizes.end()) {
+        cerr << "Can't give back a buffer that doesn't come from the volume pool" << endl;
+        exit(36);
+    }
+
+    if (found->second < POOL_MIN_BYTES || kept.size() >= POOL_MAX_KEPT) {
+        sizes.erase(found);
+        free(data_ptr);
+        return;
+    }
+
+    kept.emplace(found->second, data_ptr);
+}
+
+float *volume_pool::acquire_floats(size_t count) {
+    // two fields make a float, and the alignment is the same anyway
+    return reinterpret_cast<float *>(acquire(count * (sizeof(float) / sizeof(unsigned short))));
+}
+
+void volume_pool::release(float *data_ptr) {
+    release(reinterpret_cast<unsigned short *>(data_ptr));
+}
+
+void volume_pool::release_buffer(void *data_ptr) {
+    instance().release(static_cast<unsigned short *>(data_ptr));
+}
+
+void volume_pool::set_huge_pages(bool enabled) {
+    huge_pages = enabled;
+}
+
+void volume_pool::set_first_touch(bool enabled) {
+    first_touch = enabled;
+}
+
+volume_storage::volume_storage(unsigned short *data_ptr, bool owning) :
+    data_ptr(data_ptr),
+    owning(owning) {}
+
+volume_storage::~volume_storage() {
+    if (owning)
+        volume_pool::instance().release(data_ptr);
+}
+
+void volume_pool::trim() {
+    lock_guard<mutex> guard(lock);
+    for (auto &[bytes, data_ptr]: kept) {
+        sizes.erase(data_ptr);
+        free(data_ptr);
+    }
+    kept.clear();
+}
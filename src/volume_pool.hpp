@@ -0,0 +1,79 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_VOLUME_POOL_HPP
+#define ABGABE_CG_VIS_VOLUME_POOL_HPP
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <cstddef>
+
+using namespace std;
+
+
+// buffers below this go straight back to the system, above it they are worth keeping
+static const size_t POOL_MIN_BYTES = 1 << 20;
+// given back buffers kept for the next acquire, beyond that they go back to the system
+static const size_t POOL_MAX_KEPT = 8;
+
+
+// hands out volume buffers, aligned to cache lines (or huge pages), for the whole process,
+// and keeps the ones given back, so the next volume of about that size gets them without page faults
+class volume_pool {
+public:
+    static volume_pool &instance();
+    ~volume_pool();
+
+    volume_pool(const volume_pool &) = delete;
+    volume_pool &operator=(const volume_pool &) = delete;
+
+    // the contents are whatever the last user left there
+    unsigned short *acquire(size_t fields);
+    // scratch of the same size class, like the distance grids, which are twice the volume
+    float *acquire_floats(size_t count);
+    // only for buffers from acquire
+    void release(unsigned short *data_ptr);
+    void release(float *data_ptr);
+    // for VTK, which only knows free functions
+    static void release_buffer(void *data_ptr);
+
+    // has to be set before the first acquire, buffers of at least a huge page are aligned to one,
+    // and asked to be backed by them
+    void set_huge_pages(bool enabled);
+    // new buffers are touched by all threads, so page faults are taken in parallel,
+    // and pages land on the memory node of a thread that works on them
+    void set_first_touch(bool enabled);
+
+    // gives every kept buffer back to the system
+    void trim();
+protected:
+    volume_pool();
+
+    bool huge_pages;
+    bool first_touch;
+
+    mutex lock;
+    // every buffer handed out and not freed yet, and its size
+    unordered_map<void *, size_t> sizes;
+    // given back, by size
+    multimap<size_t, void *> kept;
+};
+
+
+// a buffer shared by every stack that holds it, the last one gives it back to the pool, if it's from there
+struct volume_storage {
+    // borrowed data isn't owned, and stays with whoever lent it
+    volume_storage(unsigned short *data_ptr, bool owning);
+    ~volume_storage();
+
+    volume_storage(const volume_storage &) = delete;
+    volume_storage &operator=(const volume_storage &) = delete;
+
+    unsigned short *data_ptr;
+    bool owning;
+};
+
+
+#endif //ABGABE_CG_VIS_VOLUME_POOL_HPP
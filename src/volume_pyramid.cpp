@@ -0,0 +1,134 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <algorithm>
+
+#include <opencv2/core.hpp>
+
+#include "volume_pyramid.hpp"
+#include "profiler.hpp"
+
+
+using namespace std;
+
+
+static void halve(const unsigned short *src, unsigned short sx, unsigned short sy, unsigned short sz,
+                  unsigned short *dst, unsigned short dx, unsigned short dy, unsigned short dz,
+                  const atomic<bool> &cancelled) {
+    // every voxel is the mean of the 2x2x2 block below it, blocks on odd edges are just smaller
+    size_t src_slice = (size_t) sx * sy;
+
+    cv::parallel_for_(cv::Range(0, dz), [&](const cv::Range &range) {
+        for (int k = range.start; k < range.end; k++) {
+            if (cancelled.load(memory_order_relaxed))
+                return;
+
+            unsigned short k_end = std::min<int>(2 * k + 2, sz);
+            for (unsigned short j = 0; j < dy; j++) {
+                unsigned short j_end = std::min<int>(2 * j + 2, sy);
+                unsigned short *dst_row = dst + ((size_t) k * dy + j) * dx;
+
+                for (unsigned short i = 0; i < dx; i++) {
+                    unsigned short i_end = std::min<int>(2 * i + 2, sx);
+                    unsigned int sum = 0;
+                    unsigned int count = 0;
+
+                    for (unsigned short sk = 2 * k; sk < k_end; sk++)
+                        for (unsigned short sj = 2 * j; sj < j_end; sj++)
+                            for (unsigned short si = 2 * i; si < i_end; si++, count++)
+                                sum += src[sk * src_slice + (size_t) sj * sx + si];
+
+                    dst_row[i] = (unsigned short) ((sum + count / 2) / count);
+                }
+            }
+        }
+    });
+}
+
+
+volume_pyramid::volume_pyramid(const unsigned short *data_ptr, unsigned short x, unsigned short y, unsigned short z,
+                               size_t max_voxels) :
+    data_ptr(data_ptr),
+    x(x),
+    y(y),
+    z(z),
+    interactive_level(0),
+    ready(0),
+    cancelled(false) {
+    pyramid_level previous{x, y, z, 1, {}};
+
+    // a level of a single voxel can't get any coarser
+    while (previous.x > 1 || previous.y > 1 || previous.z > 1) {
+        size_t voxels = (size_t) previous.x * previous.y * previous.z;
+        if (levels.size() >= 2 && voxels <= max_voxels)
+            break;
+
+        pyramid_level level{(unsigned short) ((previous.x + 1) / 2),
+                            (unsigned short) ((previous.y + 1) / 2),
+                            (unsigned short) ((previous.z + 1) / 2),
+                            (unsigned short) (previous.factor * 2),
+                            {}};
+        levels.push_back(level);
+        previous = level;
+    }
+
+    for (size_t level = 0; level <= levels.size(); level++) {
+        interactive_level = level;
+        size_t voxels = level ? (size_t) levels[level - 1].x * levels[level - 1].y * levels[level - 1].z
+                              : (size_t) x * y * z;
+        if (voxels <= max_voxels)
+            break;
+    }
+
+    builder = thread(&volume_pyramid::build, this);
+}
+
+volume_pyramid::~volume_pyramid() {
+    cancelled = true;
+    if (builder.joinable())
+        builder.join();
+}
+
+void volume_pyramid::build() {
+    scoped_timer timer("volume_pyramid::build", sizeof(unsigned short) * x * y * z, cv::getNumThreads());
+    const unsigned short *src = data_ptr;
+    unsigned short sx = x, sy = y, sz = z;
+
+    for (size_t level = 0; level < levels.size(); level++) {
+        pyramid_level &next = levels[level];
+        next.data.resize((size_t) next.x * next.y * next.z);
+        halve(src, sx, sy, sz, next.data.data(), next.x, next.y, next.z, cancelled);
+        if (cancelled)
+            return;
+
+        // the scene may pick it up from here on
+        ready.store(level + 1, memory_order_release);
+
+        src = next.data.data();
+        sx = next.x;
+        sy = next.y;
+        sz = next.z;
+    }
+}
+
+size_t volume_pyramid::get_level_count() const {
+    return levels.size();
+}
+
+size_t volume_pyramid::get_interactive_level() const {
+    return interactive_level;
+}
+
+bool volume_pyramid::is_ready(size_t level) const {
+    return level == 0 || ready.load(memory_order_acquire) >= level;
+}
+
+void volume_pyramid::wait() {
+    if (builder.joinable())
+        builder.join();
+}
+
+pyramid_level &volume_pyramid::get_level(size_t level) {
+    return levels[level - 1];
+}
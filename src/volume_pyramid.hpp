@@ -0,0 +1,70 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_VOLUME_PYRAMID_HPP
+#define ABGABE_CG_VIS_VOLUME_PYRAMID_HPP
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+
+// about what the GPU ray casts smoothly while dragging, no matter how big the full volume is
+static const size_t INTERACTIVE_VOXELS = 256 * 256 * 128;
+
+
+struct pyramid_level {
+    unsigned short x;
+    unsigned short y;
+    unsigned short z;
+    // every voxel is the mean of a block of factor^3 voxels of the full volume
+    unsigned short factor;
+    vector<unsigned short> data;
+};
+
+
+// halves the volume again and again on a background thread, at least twice,
+// and until the coarsest level has no more than max_voxels
+class volume_pyramid {
+public:
+    // the data is not copied, so it has to outlive the pyramid
+    volume_pyramid(const unsigned short *data_ptr,
+                   unsigned short x, unsigned short y, unsigned short z,
+                   size_t max_voxels = INTERACTIVE_VOXELS);
+    // stops building, whatever is left
+    ~volume_pyramid();
+
+    volume_pyramid(const volume_pyramid &) = delete;
+    volume_pyramid &operator=(const volume_pyramid &) = delete;
+
+    // level 0 is the full volume itself, so levels start at 1
+    size_t get_level_count() const;
+    // the finest level with no more than max_voxels
+    size_t get_interactive_level() const;
+    bool is_ready(size_t level) const;
+    void wait();
+    // only once it is ready
+    pyramid_level &get_level(size_t level);
+protected:
+    const unsigned short *data_ptr;
+    const unsigned short x;
+    const unsigned short y;
+    const unsigned short z;
+
+    // sized up front, so the builder never moves them while they are read
+    vector<pyramid_level> levels;
+    size_t interactive_level;
+
+    atomic<size_t> ready;
+    atomic<bool> cancelled;
+    thread builder;
+
+    void build();
+};
+
+
+#endif //ABGABE_CG_VIS_VOLUME_PYRAMID_HPP
@@ -0,0 +1,63 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <fstream>
+#include <filesystem>
+
+#include "volume_writer.hpp"
+
+namespace fs = std::filesystem;
+
+
+bool write_raw(const string &path, const unsigned short *data_ptr,
+               unsigned short x, unsigned short y, unsigned short z) {
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file)
+        return false;
+
+    size_t data_bytes = sizeof(unsigned short) * x * y * z;
+    file.write(reinterpret_cast<const char *>(data_ptr), (streamsize) data_bytes);
+    file.close();
+
+    return (bool) file;
+}
+
+bool write_meta_image(const string &path, const unsigned short *data_ptr,
+                      unsigned short x, unsigned short y, unsigned short z) {
+    // the header refers to the data file relative to itself
+    fs::path data_path = fs::path(path).replace_extension(".raw");
+
+    ofstream header(path, ios::trunc);
+    if (!header)
+        return false;
+
+    header << "ObjectType = Image\n"
+           << "NDims = 3\n"
+           << "BinaryData = True\n"
+           << "BinaryDataByteOrderMSB = False\n"
+           << "CompressedData = False\n"
+           << "DimSize = " << x << " " << y << " " << z << "\n"
+           << "ElementSpacing = 1 1 1\n"
+           << "ElementType = MET_USHORT\n"
+           << "ElementDataFile = " << data_path.filename().string() << "\n";
+    header.close();
+
+    if (!header)
+        return false;
+
+    return write_raw(data_path.string(), data_ptr, x, y, z);
+}
+
+bool write_volume(const string &path, const unsigned short *data_ptr,
+                  unsigned short x, unsigned short y, unsigned short z) {
+    if (fs::path(path).extension() == ".mhd")
+        return write_meta_image(path, data_ptr, x, y, z);
+
+    return write_raw(path, data_ptr, x, y, z);
+}
+
+bool is_volume_path(const string &path) {
+    fs::path extension = fs::path(path).extension();
+    return extension == ".raw" || extension == ".mhd";
+}
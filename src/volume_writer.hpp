@@ -0,0 +1,30 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#ifndef ABGABE_CG_VIS_VOLUME_WRITER_HPP
+#define ABGABE_CG_VIS_VOLUME_WRITER_HPP
+
+#include <string>
+
+
+using namespace std;
+
+
+// voxels are written as they are in memory, x fastest, then y, then z,
+// as little endian unsigned shorts (which is what we have on x86)
+bool write_raw(const string &path, const unsigned short *data_ptr,
+               unsigned short x, unsigned short y, unsigned short z);
+
+// writes a MetaImage header to path (.mhd), and the voxels to a .raw file next to it
+bool write_meta_image(const string &path, const unsigned short *data_ptr,
+                      unsigned short x, unsigned short y, unsigned short z);
+
+// picks one of the above by the extension of path
+bool write_volume(const string &path, const unsigned short *data_ptr,
+                  unsigned short x, unsigned short y, unsigned short z);
+
+bool is_volume_path(const string &path);
+
+
+#endif //ABGABE_CG_VIS_VOLUME_WRITER_HPP
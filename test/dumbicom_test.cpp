@@ -0,0 +1,342 @@
+//
+// Created by fynn on 17.10.26.
+//
+
+#include <random>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <gtest/gtest.h>
+
+#include "image_stack.hpp"
+#include "bit_mask.hpp"
+#include "simd_kernels.hpp"
+
+
+using namespace std;
+
+
+// odd ones, so every vector version has a tail to do, and the bit packing a partial last word
+static const vector<size_t> LENGTHS{0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 129, 1000, 4099};
+static const vector<string> INSTRUCTION_SETS{"sse4.2", "avx2", "avx512"};
+
+
+static vector<unsigned short> random_voxels(size_t count, mt19937 &random) {
+    // mostly anything, but with plenty of the values thresholds and clamping care about
+    static const unsigned short EDGES[] = {0, 1, 249, 250, 251, 0x0FFF, 0x1000, 0x7FFF, 0x8000, 0xFFFE, 0xFFFF};
+    uniform_int_distribution<int> any(0, 0xFFFF);
+    uniform_int_distribution<int> edge(0, sizeof(EDGES) / sizeof(EDGES[0]) - 1);
+    bernoulli_distribution pick_edge(.25);
+
+    vector<unsigned short> voxels(count);
+    for (unsigned short &voxel : voxels)
+        voxel = pick_edge(random) ? EDGES[edge(random)] : (unsigned short) any(random);
+    return voxels;
+}
+
+static void for_each_instruction_set(const function<void(const simd_kernels &)> &fn) {
+    // whatever the CPU doesn't have is skipped, scalar against itself proves nothing
+    for (const string &name : INSTRUCTION_SETS) {
+        if (!use_kernels(name))
+            continue;
+
+        SCOPED_TRACE(name);
+        fn(active_kernels());
+    }
+
+    use_kernels("auto");
+}
+
+// every kernel gets the same input as the scalar one, one voxel past an aligned start, so loads are unaligned too
+static void compare_in_place(const function<void(const simd_kernels &, unsigned short *, size_t)> &fn) {
+    mt19937 random(42);
+
+    for_each_instruction_set([&](const simd_kernels &kernels) {
+        for (size_t length : LENGTHS) {
+            SCOPED_TRACE(length);
+            vector<unsigned short> input = random_voxels(length + 1, random);
+            vector<unsigned short> expected = input;
+            vector<unsigned short> actual = input;
+
+            fn(scalar_kernels(), expected.data() + 1, length);
+            fn(kernels, actual.data() + 1, length);
+            EXPECT_EQ(expected, actual);
+        }
+    });
+}
+
+
+TEST(simd_kernels, threshold) {
+    compare_in_place([](const simd_kernels &kernels, unsigned short *ptr, size_t count) {
+        kernels.threshold(ptr, count, 250);
+    });
+}
+
+TEST(simd_kernels, bitwise_and) {
+    mt19937 random(7);
+    vector<unsigned short> other = random_voxels(LENGTHS.back() + 1, random);
+    compare_in_place([&](const simd_kernels &kernels, unsigned short *ptr, size_t count) {
+        kernels.bitwise_and(ptr, other.data() + 1, count);
+    });
+}
+
+TEST(simd_kernels, bitwise_or) {
+    mt19937 random(7);
+    vector<unsigned short> other = random_voxels(LENGTHS.back() + 1, random);
+    compare_in_place([&](const simd_kernels &kernels, unsigned short *ptr, size_t count) {
+        kernels.bitwise_or(ptr, other.data() + 1, count);
+    });
+}
+
+TEST(simd_kernels, scale) {
+    compare_in_place([](const simd_kernels &kernels, unsigned short *ptr, size_t count) {
+        kernels.scale(ptr, count, 1000, 3);
+    });
+}
+
+TEST(simd_kernels, shift_left) {
+    compare_in_place([](const simd_kernels &kernels, unsigned short *ptr, size_t count) {
+        kernels.shift_left(ptr, count, 4);
+    });
+}
+
+TEST(simd_kernels, min_max) {
+    mt19937 random(42);
+
+    for_each_instruction_set([&](const simd_kernels &kernels) {
+        for (size_t length : LENGTHS) {
+            SCOPED_TRACE(length);
+            vector<unsigned short> input = random_voxels(length + 1, random);
+
+            // once from scratch, and once narrowing down what's known already
+            for (pair<unsigned short, unsigned short> start : {pair<unsigned short, unsigned short>{0xFFFF, 0},
+                                                               pair<unsigned short, unsigned short>{300, 299}}) {
+                unsigned short expected_min = start.first, expected_max = start.second;
+                unsigned short actual_min = start.first, actual_max = start.second;
+                scalar_kernels().min_max(input.data() + 1, length, expected_min, expected_max);
+                kernels.min_max(input.data() + 1, length, actual_min, actual_max);
+                EXPECT_EQ(expected_min, actual_min);
+                EXPECT_EQ(expected_max, actual_max);
+            }
+        }
+    });
+}
+
+TEST(simd_kernels, threshold_bits) {
+    mt19937 random(42);
+
+    for_each_instruction_set([&](const simd_kernels &kernels) {
+        for (size_t length : LENGTHS) {
+            SCOPED_TRACE(length);
+            vector<unsigned short> input = random_voxels(length + 1, random);
+            // filled with ones, so a word that isn't written shows
+            vector<uint64_t> expected((length + 63) / 64, ~0ull);
+            vector<uint64_t> actual((length + 63) / 64, ~0ull);
+
+            scalar_kernels().threshold_bits(input.data() + 1, length, 250, expected.data());
+            kernels.threshold_bits(input.data() + 1, length, 250, actual.data());
+            EXPECT_EQ(expected, actual);
+        }
+    });
+}
+
+TEST(simd_kernels, and_bits) {
+    mt19937 random(7);
+    vector<uint64_t> bits((LENGTHS.back() + 63) / 64);
+    for (uint64_t &word : bits)
+        word = ((uint64_t) random() << 32) | random();
+
+    compare_in_place([&](const simd_kernels &kernels, unsigned short *ptr, size_t count) {
+        kernels.and_bits(ptr, count, bits.data());
+    });
+}
+
+TEST(simd_kernels, quantize) {
+    mt19937 random(42);
+    // an empty window, a narrow one, one of a single step, and the whole range
+    const vector<pair<unsigned short, unsigned short>> windows{{500, 500}, {250, 1300}, {1000, 1001}, {0, 0xFFFF}};
+
+    for_each_instruction_set([&](const simd_kernels &kernels) {
+        for (size_t length : LENGTHS) {
+            SCOPED_TRACE(length);
+            vector<unsigned short> input = random_voxels(length + 1, random);
+
+            for (auto [low, high] : windows) {
+                vector<unsigned char> expected(length), actual(length);
+                scalar_kernels().quantize(input.data() + 1, length, low, high, expected.data());
+                kernels.quantize(input.data() + 1, length, low, high, actual.data());
+                EXPECT_EQ(expected, actual) << low << ".." << high;
+            }
+        }
+    });
+}
+
+
+// bone and soft tissue all over, so the mask touches every border of the slices
+static vector<unsigned short> random_volume(unsigned short x, unsigned short y, unsigned short z, mt19937 &random) {
+    bernoulli_distribution bone(.45);
+    vector<unsigned short> voxels((size_t) x * y * z);
+    for (unsigned short &voxel : voxels)
+        voxel = bone(random) ? 1000 : 100;
+    return voxels;
+}
+
+static void compare_with_opencv(const function<void(image_stack &, unsigned short)> &stack_op,
+                                const function<void(bit_mask &, unsigned short)> &mask_op) {
+    mt19937 random(42);
+    // widths below, at and across a word, and odd everything
+    const vector<Point3D> sizes{{37, 21, 3}, {64, 16, 2}, {67, 45, 3}, {130, 9, 2}};
+    const vector<unsigned short> brushes{1, 2, 3, 4, 7, 12, 25};
+
+    for (Point3D size : sizes) {
+        vector<unsigned short> voxels = random_volume(size.x, size.y, size.z, random);
+
+        for (unsigned short brush : brushes) {
+            SCOPED_TRACE(to_string(size.x) + "x" + to_string(size.y) + "x" + to_string(size.z)
+                         + ", brush " + to_string(brush));
+
+            image_stack expected(voxels.data(), size.x, size.y, size.z);
+            expected.threshold_data(250);
+            stack_op(expected, brush);
+
+            image_stack source(voxels.data(), size.x, size.y, size.z);
+            bit_mask actual(source, 250);
+            mask_op(actual, brush);
+
+            const unsigned short *expected_ptr = expected.get_data_ptr();
+            size_t differences = 0;
+            for (unsigned short k = 0; k < size.z; k++)
+                for (unsigned short j = 0; j < size.y; j++)
+                    for (unsigned short i = 0; i < size.x; i++) {
+                        bool bit = (actual.row_at(j, k)[i / 64] >> (i % 64)) & 1;
+                        differences += bit != (expected_ptr[((size_t) k * size.y + j) * size.x + i] != 0);
+                    }
+            EXPECT_EQ(differences, 0u);
+        }
+    }
+}
+
+
+TEST(bit_mask, open) {
+    compare_with_opencv([](image_stack &s, unsigned short brush) { s.open_stack(brush); },
+                        [](bit_mask &m, unsigned short brush) { m.open_mask(brush); });
+}
+
+TEST(bit_mask, close) {
+    compare_with_opencv([](image_stack &s, unsigned short brush) { s.close_stack(brush); },
+                        [](bit_mask &m, unsigned short brush) { m.close_mask(brush); });
+}
+
+TEST(bit_mask, dilate) {
+    compare_with_opencv([](image_stack &s, unsigned short brush) { s.dilate_stack(brush); },
+                        [](bit_mask &m, unsigned short brush) { m.dilate_mask(brush); });
+}
+
+TEST(bit_mask, erode) {
+    compare_with_opencv([](image_stack &s, unsigned short brush) { s.erode_stack(brush); },
+                        [](bit_mask &m, unsigned short brush) { m.erode_mask(brush); });
+}
+
+
+// a few bone disks per slice, no smaller than the brush, so opening doesn't just wipe them out
+static vector<unsigned short> random_disks(unsigned short x, unsigned short y, unsigned short z,
+                                           unsigned short brush, mt19937 &random) {
+    uniform_int_distribution<int> column(0, x - 1), row(0, y - 1), radius(brush, 2 * brush + 2);
+    vector<unsigned short> voxels((size_t) x * y * z, 100);
+
+    for (unsigned short k = 0; k < z; k++)
+        for (int disk = 0; disk < 4; disk++) {
+            int cx = column(random), cy = row(random), r = radius(random);
+            for (int j = 0; j < y; j++)
+                for (int i = 0; i < x; i++)
+                    if ((i - cx) * (i - cx) + (j - cy) * (j - cy) <= r * r)
+                        voxels[((size_t) k * y + j) * x + i] = 1000;
+        }
+    return voxels;
+}
+
+static bool near_edge(const unsigned short *ptr, Point3D size, int i, int j, int k, int rim) {
+    // true if the window of +-rim around i, j leaves the slice, or has set and unset voxels in it
+    if (i < rim || j < rim || i + rim >= size.x || j + rim >= size.y)
+        return true;
+
+    bool set = false, unset = false;
+    for (int b = j - rim; b <= j + rim; b++)
+        for (int a = i - rim; a <= i + rim; a++) {
+            bool voxel = ptr[((size_t) k * size.y + b) * size.x + a] != 0;
+            set |= voxel;
+            unset |= !voxel;
+        }
+    return set && unset;
+}
+
+// the disk of r^2 + r is not OpenCV's ellipse, for even brushes the ellipse is one voxel narrower and off
+// center, so the two only have to agree up to a rim around the edges of either result. that is one voxel,
+// except for closing: a gap about as wide as the brush may get filled by one and not the other, which
+// reaches further in the bigger the brush gets, so it's allowed brush / 3 + 2
+static void compare_distance_with_opencv(const function<void(image_stack &, unsigned short, morphology_engine)> &op,
+                                         const function<int(unsigned short)> &rim) {
+    mt19937 random(42);
+    const vector<Point3D> sizes{{37, 21, 3}, {64, 16, 2}, {67, 45, 3}, {130, 41, 2}, {90, 70, 2}};
+    const vector<unsigned short> brushes{1, 2, 3, 4, 7, 12, 25};
+
+    for (Point3D size : sizes) {
+        for (unsigned short brush : brushes) {
+            SCOPED_TRACE(to_string(size.x) + "x" + to_string(size.y) + "x" + to_string(size.z)
+                         + ", brush " + to_string(brush));
+            vector<unsigned short> voxels = random_disks(size.x, size.y, size.z, brush, random);
+
+            image_stack expected(voxels.data(), size.x, size.y, size.z);
+            expected.threshold_data(250);
+            op(expected, brush, morphology_engine::opencv);
+
+            image_stack actual(voxels.data(), size.x, size.y, size.z);
+            actual.threshold_data(250);
+            op(actual, brush, morphology_engine::distance_disk);
+
+            const unsigned short *expected_ptr = expected.get_data_ptr();
+            const unsigned short *actual_ptr = actual.get_data_ptr();
+            size_t differences = 0, outside_rim = 0;
+            for (int k = 0; k < size.z; k++)
+                for (int j = 0; j < size.y; j++)
+                    for (int i = 0; i < size.x; i++) {
+                        size_t at = ((size_t) k * size.y + j) * size.x + i;
+                        if ((expected_ptr[at] != 0) == (actual_ptr[at] != 0))
+                            continue;
+
+                        differences++;
+                        if (!near_edge(expected_ptr, size, i, j, k, rim(brush))
+                            && !near_edge(actual_ptr, size, i, j, k, rim(brush)))
+                            outside_rim++;
+                    }
+
+            EXPECT_EQ(outside_rim, 0u) << "of " << differences << " differences";
+        }
+    }
+}
+
+
+TEST(distance_disk, open) {
+    compare_distance_with_opencv([](image_stack &s, unsigned short brush, morphology_engine engine) {
+        s.open_stack(brush, engine);
+    }, [](unsigned short) { return 1; });
+}
+
+TEST(distance_disk, close) {
+    compare_distance_with_opencv([](image_stack &s, unsigned short brush, morphology_engine engine) {
+        s.close_stack(brush, engine);
+    }, [](unsigned short brush) { return brush / 3 + 2; });
+}
+
+TEST(distance_disk, dilate) {
+    compare_distance_with_opencv([](image_stack &s, unsigned short brush, morphology_engine engine) {
+        s.dilate_stack(brush, engine);
+    }, [](unsigned short) { return 1; });
+}
+
+TEST(distance_disk, erode) {
+    compare_distance_with_opencv([](image_stack &s, unsigned short brush, morphology_engine engine) {
+        s.erode_stack(brush, engine);
+    }, [](unsigned short) { return 1; });
+}